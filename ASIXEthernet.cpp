@@ -27,24 +27,133 @@
 #define print   USBHost::print_
 #define println USBHost::println_
 
-void ASIXEthernet::init() {
+void ASIXEthernetBase::init() {
     contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-    contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+    contribute_Transfers(mytransfers, num_transfers);
     contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
+    //Drivers aren't always in zero initialised static storage
+    rxpipe = NULL;
+    txpipe = NULL;
+    interruptpipe = NULL;
+    rx_packet_queued = 0;
+    tx_packet_queued = 0;
+    pending_control = 0;
+    control_queued = false;
+    PHYSpeed = false;
+    memset(init_times, 0, sizeof(init_times));
     handleRecieve = NULL;
+    handleRecieveFrame = NULL;
+    handleWait = NULL;
+    tx_open_buffer = NULL;
+    tx_open_length = 0;
+    handleTxSpace = NULL;
+    handleLinkChange = NULL;
+    for(uint8_t i = 0; i < num_rx_buffers; i++) {
+        rx_buffer_state[i].state = RX_FREE;
+        rx_buffer_state[i].loans = 0;
+    }
+    for(uint8_t i = 0; i < num_tx_buffers; i++) tx_slot_pending[i] = 0;
+    for(uint8_t i = 0; i < maxMulticastGroups; i++) multicast_groups[i].refs = 0;
+    for(uint8_t i = 0; i < maxEtherTypeHandlers; i++) ethertype_handlers[i].state = ETHERTYPE_EMPTY;
+    memset(multicastTable, 0, sizeof(multicastTable));
     initialized = false;
     connected = false;
+    clearStatistics();
     driver_ready_for_device(this);
 }
 
-bool ASIXEthernet::claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len) {
+//Bring-up script, this order was derived from how MacOS sets this up.
+//Diagnostic steps only read registers for debugging and are skipped
+//unless setInitDiagnostics is enabled, retry is the step to go back to
+//when a verify step reads back the wrong value. Cached steps are skipped
+//when an adapter that was set up before is plugged back in
+const ASIXEthernetBase::initStep_t ASIXEthernetBase::initScript[] = {
+//   Type  Req wValue  wIndex Len Buffer       Data    Flags                        Mask  Check Retry Phase
+    {0xC0, 11, 0x0004,  0,    2, BUF_NODEID,  0,      STEP_CACHED,                 0,    0,    0,  INIT_MAC},         //Read SROM Mac Bytes 0-1
+    {0xC0, 11, 0x0005,  0,    2, BUF_NODEID,  2,      STEP_CACHED,                 0,    0,    0,  0},                //Read SROM Mac Bytes 2-3
+    {0xC0, 11, 0x0006,  0,    2, BUF_NODEID,  4,      STEP_CACHED,                 0,    0,    0,  0},                //Read SROM Mac Bytes 4-5
+    {0xC0, 11, 0x0017,  0,    2, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC,             0,    0,    0,  0},                //Read SROM Unknown Bytes 0xFFFF
+    {0xC0,  9, 0x0000,  0,    1, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC,             0,    0,    0,  0},                //Read Station Management Status Register    Determine Owner 0 010(chip code) 0 0 0 0
+    {0x40, 18, 0x0C15, 14,    0, BUF_NONE,    0,      0,                           0,    0,    0,  0},                //Write to IPG/IPG1/IPG2 Register
+    {0xC0, 17, 0x0000,  0,    3, BUF_VERIFY,  0,      STEP_VERIFY|STEP_DIAGNOSTIC, 0xFF, 0x15, 5,  0},                //Read IPG/IPG1/IPG2 Register to verify write
+    {0x40, 44, 0x007B,  0,    0, BUF_NONE,    0,      0,                           0,    0,    0,  0},                //Write to COE RX Control Register    Setup receive checks and packet drops, results are in frameInfo()
+    {0x40, 46, 0x003F,  0,    0, BUF_NONE,    0,      0,                           0,    0,    0,  0},                //Write to COE TX Control Register    Setup transmit checksum insertion, see txChecksumOffload
+    {0xC0, 33, 0x0000,  0,    1, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC,             0,    0,    0,  0},                //Read Software Interface Selection Status Register    Get current setup
+    {0x40, 34, 0x0001,  0,    0, BUF_NONE,    0,      0,                           0,    0,    0,  0},                //Write Software Interface Selection Register    Setup since default    0x01 Ethernet PHY
+    {0xC0, 33, 0x0000,  0,    1, BUF_VERIFY,  0,      STEP_VERIFY|STEP_DIAGNOSTIC, 0xFF, 0x01, 10, 0},                //Read Software Interface Selection Status Register    Verify setup
+    {0xC0, 25, 0x0000,  0,    2, BUF_PHYADDR, 0,      STEP_CACHED,                 0,    0,    0,  0},                //Ethernet/HomePNA PHY Address Register    PHY address from ROM 11h    0xE010 (default)
+    {0x40, 31, 0x00B0,  0,    0, BUF_NONE,    0,      0,                           0,    0,    0,  INIT_PHY_RESET},   //Write GPIOs Register
+    {0x40, 32, 0x0020,  0,    0, BUF_NONE,    0,      STEP_CACHED,                 0,    0,    0,  0},                //Write Power And Reset Register        20 00 Internal PHY Reset Control
+    {0x40, 32, 0x0060,  0,    0, BUF_NONE,    0,      STEP_CACHED,                 0,    0,    0,  0},                //Write Power And Reset Register        60 00 Internal PHY Reset Control & Power Down Control
+    {0x40, 32, 0x0020,  0,    0, BUF_NONE,    0,      STEP_CACHED,                 0,    0,    0,  0},                //Write Power And Reset Register        20 00 Internal PHY Reset Control
+    {0x40, 32, 0x0000,  0,    0, BUF_NONE,    0,      0,                           0,    0,    0,  0},                //Write Power And Reset Register        00 00
+    {0x40, 32, 0x0020,  0,    0, BUF_NONE,    0,      0,                           0,    0,    0,  0},                //Write Power And Reset Register        20 00 Internal PHY Reset Control
+    {0x40, 16, 0x0000,  0,    0, BUF_NONE,    0,      0,                           0,    0,    0,  0},                //Write Rx Control Register        00 00 All disabled
+    {0xC0, 19, 0x0000,  0,    6, BUF_NODEID,  0,      0,                           0,    0,    0,  0},                //Read Node ID Register            6 bytes 00 50 b6 be 8b b4 MAC address, also read earlier
+    {0x40, 38, 0x003F,  0,    0, BUF_NONE,    0,      0,                           0,    0,    0,  0},                //Write Jam Limit Count Register        3Fh (default)
+    {0xC0, 28, 0x0000,  0,    1, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC,             0,    0,    0,  0},                //Read Monitor Mode Status Register        72
+    {0x40,  6, 0x0000,  0,    0, BUF_NONE,    0,      0,                           0,    0,    0,  INIT_PHY_SETUP},   //Write Software Station Management Control Register    Request Ownership
+    {0xC0,  9, 0x0000,  0,    1, BUF_VERIFY,  0,      STEP_VERIFY,                 0x01, 0x01, 23, 0},                //Read Station Management Status Register        Check Ownership     0 010(chip) 0 0 0 1(Owner)
+    {0xC0,  7, 0x0010,  2,    2, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC|STEP_PHY,    0,    0,    0,  0},                //Read PHY Register  02h            PHY Id Reg 1 003Bh (default)  OUI MSB
+    {0xC0,  9, 0x0000,  0,    1, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC,             0,    0,    0,  0},                //Read Station Management Status Register        Check Ownership     0 010(chip) 0 0 0 1(Owner)
+    {0xC0,  7, 0x0010,  0,    2, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC|STEP_PHY,    0,    0,    0,  0},                //Read PHY Register  00h        Basic Mode Ctr Reg 3100h (default) AutoNeg Full Duplex
+    {0xC0,  7, 0x0010,  4,    2, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC|STEP_PHY,    0,    0,    0,  0},                //Read PHY Register  04h    Auto Neg Ad Reg 05E1h (01E1h) 0 0 0 00 1 0 1 1 1 1 00001 Duplex Pause
+    {0x40,  8, 0x0010,  4,    2, BUF_DATA,    phyAdvertisement, STEP_PHY,              0,    0,    0,  0},                //Write PHY Register 04h    Auto Neg Ad Reg 05E1h (01E1h) 0 0 0 00 1 0 1 1 1 1 00001 Duplex Pause
+    {0x40,  8, 0x0010,  0,    2, BUF_DATA,    0x3300, STEP_PHY,                    0,    0,    0,  0},                //Write PHY Register 00h        Basic Mode Ctr Reg 3300h (3100h) Reset AutoNeg Full Duplex
+    {0xC0,  7, 0x0010,  0,    2, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC|STEP_PHY,    0,    0,    0,  0},                //Read PHY Register 00h        Basic Mode Ctr Reg 3100h  (3100h) AutoNeg Full Duplex
+    {0xC0,  7, 0x0010, 18,    2, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC|STEP_PHY,    0,    0,    0,  0},                //Read PHY Register        Unknown 22 86
+    {0x40,  8, 0x0010, 18,    2, BUF_DATA,    0x862F, STEP_PHY,                    0,    0,    0,  0},                //Write PHY Register        Unknown 2f 86    Reset?
+    {0xC0,  7, 0x0010, 18,    2, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC|STEP_PHY,    0,    0,    0,  0},                //Read PHY Register        Unknown 22 86
+    {0x40, 27, mediumModeDefault, 0, 0, BUF_NONE, 0,     0,                           0,    0,    0,  0},                //Write Medium Mode Register    36 03  0011 0110  0000 0011 Enable F Duplex & Flow Control
+    {0x40, 10, 0x0000,  0,    0, BUF_NONE,    0,      0,                           0,    0,    0,  0},                //Write Hdwr Stn Mngmnt Ctr Reg    Release Ownership
+    {0x40, 18, 0x1615, 26,    0, BUF_NONE,    0,      0,                           0,    0,    0,  0},                //Write to IPG/IPG1/IPG2 Register    15 16 1a
+    {0xC0, 11, 0x0018,  0,    2, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC,             0,    0,    0,  0},                //Read SROM Register        18h PHY Power Saving Config & checksum c0 09
+    {0x40, 32, 0x0920,  0,    0, BUF_NONE,    0,      0,                           0,    0,    0,  0},                //Write Power And Reset Register        20 09 Intrnl PHY Rst Ctr & Cbl pwr sav Hdwr, sav lvl 1
+    {0x40, 42, 0x8400, 0x851E, 0, BUF_NONE,   0,      STEP_AGGREGATION,            0,    0,    0,  INIT_RX_SETUP},    //Write transfer size
+    {0x40, 16, 0x0338,  0,    0, BUF_NONE,    0,      0,                           0,    0,    0,  0},                //Write Rx Control Register    38 03  Strt Op, BCast, RX Hdr Mode
+    {0x40, 16, 0x0398,  0,    0, BUF_NONE,    0,      STEP_RXCTL,                  0,    0,    0,  0},                //Write Rx Control Register    98 03  Strt Op, MCast, BCast, RX Hdr Mode
+    {0x40, 16, 0x0388,  0,    0, BUF_NONE,    0,      0,                           0,    0,    0,  0},                //Write Rx Control Register    88 03  Strt Op, BCast, RX Hdr Mode
+    {0x40, 16, 0x03D8,  0,    0, BUF_NONE,    0,      STEP_RXCTL,                  0,    0,    0,  0},                //Write Rx Control Register    D8 03  Strt Op, MCast, BCast, RX Hdr Mode, multicast is filtered by the hash table
+};
+
+//Run after bring-up and each time the link comes up, only the partner
+//ability read, medium mode and the registers after it are needed to relink
+const ASIXEthernetBase::initStep_t ASIXEthernetBase::linkScript[] = {
+//   Type  Req wValue  wIndex Len Buffer       Data    Flags                        Mask  Check Retry Phase
+    {0x40,  6, 0x0000,  0,    0, BUF_NONE,    0,      STEP_DIAGNOSTIC,             0,    0,    0,  0},                //Write Software Station Management Control Register    Request Ownership
+    {0xC0,  9, 0x0000,  0,    1, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC,             0,    0,    0,  0},                //Read Station Management Status Register        Check Ownership     0 010(chip) 0 0 0 1(Owner)
+    {0xC0,  7, 0x0010,  0,    2, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC|STEP_PHY,    0,    0,    0,  0},                //Read PHY Register 00h        Basic Mode Ctr Reg 3100h (default) AutoNeg Full Duplex
+    {0xC0,  7, 0x0010,  1,    2, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC|STEP_PHY,    0,    0,    0,  0},                //Read PHY Register 01h    Bsc mode stat reg 2D 78 Duplex Capable, auto neg done, Linked, extended
+    {0x40, 10, 0x0000,  0,    0, BUF_NONE,    0,      STEP_DIAGNOSTIC,             0,    0,    0,  0},                //Write Hdwr Stn Mngmnt Ctr Reg    Release Ownership
+    {0x40,  6, 0x0000,  0,    0, BUF_NONE,    0,      0,                           0,    0,    0,  INIT_LINK},        //Write Software Station Management Control Register    Request Ownership
+    {0xC0,  9, 0x0000,  0,    1, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC,             0,    0,    0,  0},                //Read Station Management Status Register        Check Ownership     0 010(chip) 0 0 0 1(Owner)
+    {0xC0,  7, 0x0010,  0,    2, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC|STEP_PHY,    0,    0,    0,  0},                //Read PHY Register 00h        Basic Mode Ctr Reg 3100h (default) AutoNeg Full Duplex
+    {0xC0,  7, 0x0010,  1,    2, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC|STEP_PHY,    0,    0,    0,  0},                //Read PHY Register 01h    Bsc mode stat reg 2D 78 Duplex Capable, auto neg done, Linked, extended
+    {0xC0,  7, 0x0010,  2,    2, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC|STEP_PHY,    0,    0,    0,  0},                //Read PHY Register 02h        PHY Id Reg 1 003Bh (default)  OUI MSB
+    {0xC0,  7, 0x0010,  3,    2, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC|STEP_PHY,    0,    0,    0,  0},                //Read PHY Register 03h        PHY Id Reg 2 1881h (default)  OUI LSB
+    {0xC0,  7, 0x0010,  4,    2, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC|STEP_PHY,    0,    0,    0,  0},                //Read PHY Register 04h    Auto Neg Ad Reg 05E1h (01E1h) 0 0 0 00 1 0 1 1 1 1 00001 Duplex Pause
+    {0xC0,  7, 0x0010,  5,    2, BUF_LINK,    0,      STEP_PHY,                    0,    0,    0,  0},                //Read PHY Register 05h    Auto neg link prtnr abl reg C101h (0000h) Duplex modes, ptcl sel bits
+    {0xC0,  7, 0x0010,  6,    2, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC|STEP_PHY,    0,    0,    0,  0},                //Read PHY Register 06h    Auto neg expnsn reg 000Bh (0000h) page en, new page, auto neg acpt
+    {0x40, 10, 0x0000,  0,    0, BUF_NONE,    0,      0,                           0,    0,    0,  0},                //Write Hdwr Stn Mngmnt Ctr Reg    Release Ownership
+    {0xC0, 26, 0x0000,  0,    2, BUF_SCRATCH, 0,      STEP_DIAGNOSTIC,             0,    0,    0,  0},                //Read Medium Status Register    36 03 0011 0110  0000 0011 F Duplex & Flow Control Enabled
+    {0x40, 27, mediumModeDefault, 0, 0, BUF_NONE, 0,     STEP_MEDIUM,                 0,    0,    0,  0},                //Write Medium Mode Register    Negotiated speed, duplex and flow control, see medium_mode
+    {0x40, 42, 0x8400, 0x851E, 0, BUF_NONE,   0,      STEP_AGGREGATION,            0,    0,    0,  0},                //Write transfer size
+    {0x40, 22, 0x0000,  0,    8, BUF_MULTICAST, 0,    STEP_MULTICAST,              0,    0,    0,  0},                //Write Multicast Filter Array Register    Hash table of joined groups, see multicast_update
+};
+
+constexpr ASIXEthernetBase::aggregationLevel_t ASIXEthernetBase::aggregationLevels[numAggregationLevels];
+
+ASIXEthernetBase::adapterCache_t ASIXEthernetBase::adapter_cache[maxCachedAdapters];
+uint8_t ASIXEthernetBase::adapter_cache_next = 0;
+
+bool ASIXEthernetBase::claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len) {
     
     const uint8_t *p = descriptors;
     const uint8_t *end = p + len;
     
     if(type != 1) return false;
     if(dev->idVendor != 0x0B95) return false;
-    println("ASIXEthernet claim this=", (uint32_t)this, HEX);
+    println("ASIXEthernet claim this=", (uint32_t)(uintptr_t)this, HEX);
     println("type=", type);
     print("vid=", dev->idVendor, HEX);
     print(", pid=", dev->idProduct, HEX);
@@ -131,13 +240,8 @@ bool ASIXEthernet::claim(Device_t *dev, int type, const uint8_t *descriptors, ui
         rxpipe = new_Pipe(dev, 2, rx_ep, 1, rx_size, rx_interval);
         if (rxpipe) {
             rxpipe->callback_function = rx_callback;
-            
-            rx_buffer = (uint8_t*)rx_buffer0 + (current_rx_buffer * transferSize);
-            if(current_rx_buffer == (num_rx_buffers - 1)) current_rx_buffer = 0;
-            else current_rx_buffer++;
-            
-            queue_Data_Transfer(rxpipe, rx_buffer, transferSize, this);
-            rx_packet_queued++;
+            rx_packet_queued = 0;
+            for(uint8_t i = 0; i < num_rx_buffers; i++) rx_queue(i); //Loaned buffers are queued when released
         }
     } else {
         rxpipe = NULL;
@@ -164,498 +268,265 @@ bool ASIXEthernet::claim(Device_t *dev, int type, const uint8_t *descriptors, ui
     }
     
     println("Control - ASIX...");
-    mk_setup(setup, 0xc0, 11, 0x0004, 0, 2);
-    queue_Control_Transfer(dev, &setup, nodeID, this);
-    control_queued = true;
-    pending_control = 1;
+    init_times[INIT_CLAIM] = micros();
+    control_device = dev;
+    control_queued = false;
+    init_cache_lookup(dev);
+    init_pending = true;
+    control_start(initScript, sizeof(initScript)/sizeof(initStep_t));
     return (rxpipe || txpipe || interruptpipe);
 }
 
-void ASIXEthernet::control(const Transfer_t *transfer) {
-    println("control callback (asix) ", pending_control, DEC);
+void ASIXEthernetBase::control(const Transfer_t *transfer) {
     control_queued = false;
-pending:
-    switch (pending_control) { //This order was derived from how MacOS sets this up
-        case 1:                                                         //Get Mac Bytes 2-3
-            mk_setup(setup, 0xc0, 11, 0x0005, 0, 2);
-            queue_Control_Transfer(device, &setup, nodeID + 2, this);
-            control_queued = true;
-            pending_control = 2;
-            break;
-        case 2:                                                         //Get Mac Bytes 4-5
-            mk_setup(setup, 0xc0, 11, 0x0006, 0, 2);
-            queue_Control_Transfer(device, &setup, nodeID + 4, this);
-            control_queued = true;
-            pending_control = 3;
-            break;
-        case 3:        //Probably not needed                            //Get Unknown Bytes 0xFFFF
-            print("nodeID: ");
-            print_hexbytes(nodeID, 6);
-            
-            mk_setup(setup, 0xc0, 11, 0x0017, 0, 2);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 4;
+    if(control_request_active) {
+        control_request_active = false;
+        control_complete();
+        if(pending_control == 254 || pending_control == 255) {
+            control_next();
             return;
-        case 4:                                                         //Read Station Management Status Register    Determine Owner 0 010(chip code) 0 0 0 0
-            mk_setup(setup, 0xc0, 9, 0x0000, 0, 1);
-            queue_Control_Transfer(device, &setup, owner, this);
-            control_queued = true;
-            pending_control = 5;
-            break;
-        case 5:                                                         //Write to IPG/IPG1/IPG2 Register
-            mk_setup(setup, 0x40, 18, 0x0C15, 14, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 6;
-            break;
-        case 6:                                                         //Read IPG/IPG1/IPG2 Register to verify write
-            mk_setup(setup, 0xC0, 17, 0x0000, 0, 3);
-            queue_Control_Transfer(device, &setup, verify, this);
-            control_queued = true;
-            pending_control = 7;
-            break;
-        case 7:                                                         //Write to COE RX Control Register    Setup receive checks and packet drops
-            if(verify[0] != 0x15 && verify[1] != 0x0C && verify[2] != 0x0E) {
-                print("verify: ");
-                print_hexbytes(verify, 3);
-                pending_control = 5;
-                goto pending;
-            }
-            mk_setup(setup, 0x40, 44, 0x007B, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 8;
-            break;
-        case 8:                                                         //Write to COE TX Control Register    Setup transmit checksum insertion
-            mk_setup(setup, 0x40, 46, 0x003F, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 9;
-            break;
-        case 9:                                                         //Read Software Interface Selection Status Register    Get current setup
-            mk_setup(setup, 0xC0, 33, 0x0000, 0, 1);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 10;
-            break;
-        case 10:                                                        //Write Software Interface Selection Register    Setup since default    0x01 Ethernet PHY
-            mk_setup(setup, 0x40, 34, 0x0001, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 11;
-            break;
-        case 11:                                                        //Read Software Interface Selection Status Register    Verify setup
-            mk_setup(setup, 0xC0, 33, 0x0000, 0, 1);
-            queue_Control_Transfer(device, &setup, verify, this);
-            control_queued = true;
-            pending_control = 12;
-            break;
-        case 12:                                                        //Ethernet/HomePNA PHY Address Register    PHY address from ROM 11h    0xE010 (default)
-            //The value read here should technically be used later on when
-            //reading/writing the PHY, but is currently not being used
-            if(verify[0] != 0x01) {
-                pending_control = 10;
-                goto pending;
-            }
-            mk_setup(setup, 0xC0, 25, 0x0000, 0, 2);
-            queue_Control_Transfer(device, &setup, PHYAddressReg, this);
-            control_queued = true;
-            pending_control = 13;
-            break;
-        case 13:                                                        //Write GPIOs Register
-            mk_setup(setup, 0x40, 31, 0x00B0, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 14;
-            break;
-        case 14:                                                        //Write Power And Reset Register        20 00 Internal PHY Reset Control
-            mk_setup(setup, 0x40, 32, 0x0020, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 15;
-            break;
-        case 15:                                                        //Write Power And Reset Register        60 00 Internal PHY Reset Control & Power Down Control
-            mk_setup(setup, 0x40, 32, 0x0060, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 16;
-            break;
-        case 16:                                                        //Write Power And Reset Register        20 00 Internal PHY Reset Control
-            mk_setup(setup, 0x40, 32, 0x0020, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 17;
-            break;
-        case 17:                                                        //Write Power And Reset Register        00 00
-            mk_setup(setup, 0x40, 32, 0x0000, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 18;
-            break;
-        case 18:                                                        //Write Power And Reset Register        20 00 Internal PHY Reset Control
-            mk_setup(setup, 0x40, 32, 0x0020, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 19;
-            break;
-        case 19:                                                        //Write Rx Control Register        00 00 All disabled
-            mk_setup(setup, 0x40, 16, 0x0000, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 20;
-            break;
-        case 20:                                                        //Read Node ID Register            6 bytes 00 50 b6 be 8b b4 MAC address, also read earlier
-            mk_setup(setup, 0xC0, 19, 0x0000, 0, 6);
-            queue_Control_Transfer(device, &setup, nodeID, this);
-            control_queued = true;
-            pending_control = 21;
-            break;
-        case 21:                                                        //Write Jam Limit Count Register        3Fh (default)
-            mk_setup(setup, 0x40, 38, 0x003F, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 22;
-            break;
-        case 22:                                                        //Read Monitor Mode Status Register        72
-            mk_setup(setup, 0xC0, 28, 0x0000, 0, 1);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 23;
-            break;
-        case 23:                                                        //Write Software Station Management Control Register    Request Ownership
-            mk_setup(setup, 0x40, 6, 0x0000, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 24;
-            break;
-        case 24:                                                        //Read Station Management Status Register        Check Ownership     0 010(chip) 0 0 0 1(Owner)
-            mk_setup(setup, 0xC0, 9, 0x0000, 0, 1);
-            queue_Control_Transfer(device, &setup, verify, this);
-            control_queued = true;
-            pending_control = 25;
-            break;
-        case 25:                                                        //Read PHY Register  02h            PHY Id Reg 1 003Bh (default)  OUI MSB
-            if((verify[0] & 1) != 1){
-                pending_control = 23;
-                goto pending;
+        }
+        //Otherwise a script is waiting for the request to finish
+    }
+    else if(pending_control == 1) {
+        const initStep_t &step = control_script[control_step];
+        if((step.flags & STEP_VERIFY) && (verify[0] & step.mask) != step.check) {
+            print("verify: ");
+            print_hexbytes(verify, step.length);
+            ASIX_STAT(stats.controlRetries++);
+            if(++control_retries < maxInitRetries) control_step = step.retry;
+            else control_step++;
+        }
+        else {
+            control_retries = 0;
+            control_step++;
+        }
+    }
+    control_run();
+}
+
+void ASIXEthernetBase::control_start(const initStep_t *script, uint8_t length) {
+    control_script = script;
+    control_script_length = length;
+    control_step = 0;
+    control_retries = 0;
+    pending_control = 1;
+    if(!control_queued) control_run(); //Otherwise started when the queued request completes
+}
+
+void ASIXEthernetBase::control_run() {
+    if(pending_control != 1) {
+        control_next();
+        return;
+    }
+    while(control_step < control_script_length) {
+        const initStep_t &step = control_script[control_step];
+        if(step.phase) init_times[step.phase] = micros();
+        bool skip = (step.flags & STEP_DIAGNOSTIC) && !init_diagnostics;
+        if((step.flags & STEP_CACHED) && init_cache_slot < maxCachedAdapters) skip = true;
+        if(step.flags & STEP_MULTICAST) {
+            skip = true;
+            for(uint8_t i = 0; i < 8; i++) {
+                if(multicastTable[i]) skip = false;
             }
-            mk_setup(setup, 0xC0, 7, 0x0010, 2, 2);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 26;
-            break;
-        case 26:                                                        //Read Station Management Status Register        Check Ownership     0 010(chip) 0 0 0 1(Owner)
-            mk_setup(setup, 0xC0, 9, 0x0000, 0, 1);
-            queue_Control_Transfer(device, &setup, verify, this);
-            control_queued = true;
-            pending_control = 27;
-            break;
-        case 27:                                                        //Read PHY Register  01h        Basic Mode Ctr Reg 3100h (default) AutoNeg Full Duplex
-            mk_setup(setup, 0xC0, 7, 0x0010, 0, 2);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 28;
-            break;
-        case 28:                                                        //Read PHY Register  01h        Basic Mode Ctr Reg 3100h (default) AutoNeg Full Duplex
-            mk_setup(setup, 0xC0, 7, 0x0010, 0, 2);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 29;
-            break;
-        case 29:                                                        //Read PHY Register  04h    Auto Neg Ad Reg 05E1h (01E1h) 0 0 0 00 1 0 1 1 1 1 00001 Duplex Pause
-            mk_setup(setup, 0xC0, 7, 0x0010, 4, 2);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 30;
-            break;
-        case 30:{                                                        //Write PHY Register 04h    Auto Neg Ad Reg 05E1h (01E1h) 0 0 0 00 1 0 1 1 1 1 00001 Duplex Pause
-            mk_setup(setup, 0x40, 8, 0x0010, 4, 2);
-            uint8_t xfr[2] = {0xE1, 0x05};
-            queue_Control_Transfer(device, &setup, xfr, this);
-            control_queued = true;
-            pending_control = 31;
-            break;}
-        case 31:{                                                        //Write PHY Register 01h        Basic Mode Ctr Reg 3300h (3100h) Reset AutoNeg Full Duplex
-            mk_setup(setup, 0x40, 8, 0x0010, 0, 2);
-            uint8_t xfr[2] = {0x00, 0x33};
-            queue_Control_Transfer(device, &setup, xfr, this);
-            control_queued = true;
-            pending_control = 32;
-            break;}
-        case 32:                                                        //Read PHY Register 01h        Basic Mode Ctr Reg 3100h  (3100h) AutoNeg Full Duplex
-            mk_setup(setup, 0xC0, 7, 0x0010, 0, 2);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 33;
-            break;
-        case 33:                                                        //Read PHY Register        Unknown 22 86
-            mk_setup(setup, 0xC0, 7, 0x0010, 18, 2);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 34;
-            break;
-        case 34:{                                                        //Write PHY Register        Unknown 2f 86    Reset?
-            mk_setup(setup, 0x40, 8, 0x0010, 18, 2);
-            uint8_t xfr[2] = {0x2F, 0x86};
-            queue_Control_Transfer(device, &setup, xfr, this);
-            control_queued = true;
-            pending_control = 35;
-            break;}
-        case 35:                                                        //Read PHY Register        Unknown 22 86
-            mk_setup(setup, 0xC0, 7, 0x0010, 18, 2);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 36;
-            break;
-        case 36:                                                        //Write Medium Mode Register    36 03  0011 0110  0000 0011 Enable F Duplex & Flow Control
-            mk_setup(setup, 0x40, 27, 0x0336, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 37;
-            break;
-        case 37:                                                        //Write Hdwr Stn Mngmnt Ctr Reg    Release Ownership
-            mk_setup(setup, 0x40, 10, 0x0000, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 38;
-            break;
-        case 38:                                                        //Write to IPG/IPG1/IPG2 Register    15 16 1a
-            mk_setup(setup, 0x40, 18, 0x1615, 26, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 39;
-            break;
-        case 39:                                                        //Read SROM Register        18h PHY Power Saving Config & checksum c0 09
-            mk_setup(setup, 0xC0, 11, 0x0018, 0, 2);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 40;
-            break;
-        case 40:                                                        //Write Power And Reset Register        20 09 Intrnl PHY Rst Ctr & Cbl pwr sav Hdwr, sav lvl 1
-            mk_setup(setup, 0x40, 32, 0x0920, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 41;
-            break;
-        case 41:                                                        //Write transfer size
-            //0x8000, 0x8001 2k buffers
-            //0x8100, 0x8147 4k buffers
-            //0x8300, 0x83D7 8k buffers
-            //0x8400, 0x851E 16k buffers
-            //0x8600, 0x87AE 24k buffers
-            //0x8700, 0x8A3D 32k buffers
-            mk_setup(setup, 0x40, 42, 0x8400, 0x851E, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 42;
-            break;
-        case 42:                                                        //Write Rx Control Register    88 03  Strt Op, BCast, RX Hdr Mode
-            mk_setup(setup, 0x40, 16, 0x0338, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 43;
-            break;
-        case 43:                                                        //Write Rx Control Register    98 03  Strt Op, MCast, BCast, RX Hdr Mode
-            if(PACKET_TYPE_PROMISCUOUS) mk_setup(setup, 0x40, 16, 0x0389, 0, 0);
-            else mk_setup(setup, 0x40, 16, 0x0398, 0, 0);
-            println("Promiscuous: ", PACKET_TYPE_PROMISCUOUS, DEC);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 45; //Skip multicast filter
-            break;
-        case 44:{                                                        //Write Multicast Filter Array Register 00 00 00 00  00 00 00 00
-            mk_setup(setup, 0x40, 22, 0x0000, 0, 8);
-            uint8_t xfr[8] = {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00};
-            queue_Control_Transfer(device, &setup, xfr, this);
-            control_queued = true;
-            pending_control = 45;
-            break;}
-        case 45:                                                        //Write Rx Control Register    88 03  Strt Op, BCast, RX Hdr Mode
-            mk_setup(setup, 0x40, 16, 0x0388, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 46;
-            break;
-        case 46:                                                        //Write Rx Control Register    98 03  Strt Op, MCast, BCast, RX Hdr Mode
-            if(PACKET_TYPE_PROMISCUOUS) mk_setup(setup, 0x40, 16, 0x03C9, 0, 0);
-            else mk_setup(setup, 0x40, 16, 0x03C8, 0, 0);
-            println("Promiscuous: ", PACKET_TYPE_PROMISCUOUS, DEC);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 48; //Skip multicast filter
-            break;
-        case 47:{                                                        //Write Multicast Filter Array Register 00 40 00 00  00 00 00 00
-            mk_setup(setup, 0x40, 22, 0x0000, 0, 8);
-            uint8_t xfr[8] = {0x00,0x40,0x00,0x00,0x00,0x00,0x00,0x00};
-            queue_Control_Transfer(device, &setup, xfr, this);
-            control_queued = true;
-            pending_control = 255;                      //Starts searching for network
-            break;}
-        case 48:                                                        //Write Software Station Management Control Register    Request Ownership
-            mk_setup(setup, 0x40, 6, 0x0000, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 49;
-            return;
-        case 49:                                                        //Read Station Management Status Register        Check Ownership     0 010(chip) 0 0 0 1(Owner)
-            mk_setup(setup, 0xC0, 9, 0x0000, 0, 1);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 50;
-            break;
-        case 50:                                                        //Read PHY Register 00h        Basic Mode Ctr Reg 3100h (default) AutoNeg Full Duplex
-            mk_setup(setup, 0xC0, 7, 0x0010, 0, 2);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 51;
-            break;
-        case 51:                                                        //Read PHY Register 01h    Bsc mode stat reg 2D 78 Duplex Capable, auto neg done, Linked, extended
-            mk_setup(setup, 0xC0, 7, 0x0010, 1, 2);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 52;
-            break;
-        case 52:                                                        //Write Hdwr Stn Mngmnt Ctr Reg    Release Ownership
-            mk_setup(setup, 0x40, 10, 0x0000, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 53;
-            break;
-        case 53:                                                        //Write Software Station Management Control Register    Request Ownership
-            mk_setup(setup, 0x40, 6, 0x0000, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 54;
-            break;
-        case 54:                                                        //Read Station Management Status Register        Check Ownership     0 010(chip) 0 0 0 1(Owner)
-            mk_setup(setup, 0xC0, 9, 0x0000, 0, 1);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 55;
-            break;
-        case 55:                                                        //Read PHY Register 00h        Basic Mode Ctr Reg 3100h (default) AutoNeg Full Duplex
-            mk_setup(setup, 0xC0, 7, 0x0010, 0, 2);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 56;
-            break;
-        case 56:                                                        //Read PHY Register 01h    Bsc mode stat reg 2D 78 Duplex Capable, auto neg done, Linked, extended
-            mk_setup(setup, 0xC0, 7, 0x0010, 1, 2);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 57;
-            break;
-        case 57:                                                        //Read PHY Register 02h        PHY Id Reg 1 003Bh (default)  OUI MSB
-            mk_setup(setup, 0xC0, 7, 0x0010, 2, 2);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 58;
-            break;
-        case 58:                                                        //Read PHY Register 03h        PHY Id Reg 2 1881h (default)  OUI LSB
-            mk_setup(setup, 0xC0, 7, 0x0010, 3, 2);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 59;
-            break;
-        case 59:                                                        //Read PHY Register 04h    Auto Neg Ad Reg 05E1h (01E1h) 0 0 0 00 1 0 1 1 1 1 00001 Duplex Pause
-            mk_setup(setup, 0xC0, 7, 0x0010, 4, 2);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 60;
-            break;
-        case 60:                                                        //Read PHY Register 05h    Auto neg link prtnr abl reg C101h (0000h) Duplex modes, ptcl sel bits
-            mk_setup(setup, 0xC0, 7, 0x0010, 5, 2);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 61;
-            break;
-        case 61:                                                        //Read PHY Register 06h    Auto neg expnsn reg 000Bh (0000h) page en, new page, auto neg acpt
-            mk_setup(setup, 0xC0, 7, 0x0010, 6, 2);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 62;
-            break;
-        case 62:                                                        //Write Hdwr Stn Mngmnt Ctr Reg    Release Ownership
-            mk_setup(setup, 0x40, 10, 0x0000, 0, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 63;
-            break;
-        case 63:                                                        //Read Medium Status Register    36 03 0011 0110  0000 0011 F Duplex & Flow Control Enabled
-            mk_setup(setup, 0xC0, 26, 0x0000, 0, 2);
-            queue_Control_Transfer(device, &setup, setupdata, this);
-            control_queued = true;
-            pending_control = 64;
-            break;
-        case 64:                                                        //Write transfer size
-            //0x8000, 0x8001 2k buffers
-            //0x8100, 0x8147 4k buffers
-            //0x8300, 0x83D7 8k buffers
-            //0x8400, 0x851E 16k buffers
-            //0x8600, 0x87AE 24k buffers
-            //0x8700, 0x8A3D 32k buffers
-            mk_setup(setup, 0x40, 42, 0x8400, 0x851E, 0);
-            queue_Control_Transfer(device, &setup, NULL, this);
-            control_queued = true;
-            pending_control = 254; //Skip multicast filter
-            initialized = true;
-            connected = true;
-            break;
-            
-        case 65:{                                                       //This sets the multicast address filter array bitmap, I haven't been able to figure out how this is supposed to be calculated. Their manual doesn't specify too well and all my efforts have been deadends. Setting all these to 0xFF lets all multicast messages through lowering bandwidth for other messages.
-            mk_setup(setup, 0x40, 22, 0x0000, 0, 8);
-//            uint8_t xfr[8] = {B01000000,B10000000,0x20,0x40,B10000000,0x00,0x80,B00010000};
-            uint8_t xfr[8] = {0,0,0,0,0,0,0,0};
-            queue_Control_Transfer(device, &setup, xfr, this);
-            control_queued = true;
-            pending_control = 254;
-            initialized = true;
-            connected = true;
-            break;}
-        default:
+        }
+        if(skip) {
+            control_step++;
+            continue;
+        }
+        uint16_t wValue = step.wValue;
+        uint16_t wIndex = step.wIndex;
+        uint8_t *buffer = NULL;
+        if(step.flags & STEP_RXCTL) wValue = rx_control(rx_mode_wanted, wValue);
+        if(step.flags & STEP_AGGREGATION) {
+            wValue = rx_aggregation[0];
+            wIndex = rx_aggregation[1];
+        }
+        if(step.flags & STEP_MEDIUM) wValue = medium_mode();
+        if(step.flags & STEP_PHY) wValue = PHYAddressReg[1];
+        switch (step.buffer) {
+            case BUF_SCRATCH: buffer = setupdata; break;
+            case BUF_VERIFY: buffer = verify; break;
+            case BUF_NODEID: buffer = nodeID + step.data; break;
+            case BUF_PHYADDR: buffer = PHYAddressReg; break;
+            case BUF_MULTICAST: buffer = multicastTable; break;
+            case BUF_LINK: buffer = link_partner; break;
+            case BUF_DATA:
+                setupdata[0] = step.data & 0xFF;
+                setupdata[1] = (step.data >> 8) & 0xFF;
+                buffer = setupdata;
+                break;
+            default: break;
+        }
+        println("control step (asix) ", control_step, DEC);
+        mk_setup(setup, step.bmRequestType, step.bRequest, wValue, wIndex, step.length);
+        queue_Control_Transfer(control_device, &setup, buffer, this);
+        control_queued = true;
+        return;
+    }
+    
+    if(control_script == initScript) {
+        print("nodeID: ");
+        print_hexbytes(nodeID, 6);
+        println("RX mode: ", rx_mode_wanted, HEX);
+        if(!rx_mode_writes) rx_mode_confirmed = rx_mode_wanted;
+        control_start(linkScript, sizeof(linkScript)/sizeof(initStep_t));
+        return;
+    }
+    init_times[INIT_READY] = micros();
+    println("Init time (us): ", init_times[INIT_READY] - init_times[INIT_CLAIM], DEC);
+    if(init_pending) init_cache_update();
+    init_pending = false;
+    control_script = NULL;
+    initialized = true;
+    if(!link_up) {
+        //The link dropped while the script ran, interrupt_data only marks
+        //ready scripts so wait here for it to come back and run linkScript
+        pending_control = 255;
+        connected = false;
+        control_next();
+        return;
+    }
+    pending_control = 254;
+    connected = true;
+    if(handleLinkChange) (*handleLinkChange)(true, PHYSpeed, link_full_duplex);
+    control_next();
+}
+
+uint16_t ASIXEthernetBase::medium_mode() {
+    //Resolve the mode both ends advertised, highest first. Without an
+    //autonegotiation result keep the bring-up default
+    uint16_t partner = linkPartnerAbility();
+    uint16_t common = partner & phyAdvertisement;
+    if(!(common & 0x01E0)) {
+        link_full_duplex = true;
+        return mediumModeDefault;
+    }
+    bool speed100 = common & 0x0180;
+    link_full_duplex = speed100 ? (common & 0x0100) : (common & 0x0040);
+    PHYSpeed = speed100;
+    uint16_t mode = 0x0104;                 //Recieve enable, always 1
+    if(speed100) mode |= 0x0200;            //Port speed 100M
+    if(link_full_duplex) {
+        mode |= 0x0002;                     //Full duplex
+        if(common & 0x0400) mode |= 0x0030; //Recieve and transmit flow control
+    }
+    return mode;
+}
+
+void ASIXEthernetBase::init_cache_lookup(Device_t *dev) {
+    //Adapters are told apart by their serial number string, collected
+    //during enumeration before claim
+    init_serial = 0;
+    init_serial_known = false;
+    if(dev->strbuf) {
+        const uint8_t *serial = &dev->strbuf->buffer[dev->strbuf->iStrings[strbuf_t::STR_ID_SERIAL]];
+        uint32_t length = strlen((const char*)serial);
+        init_serial = ASIXFraming::etherCrc(serial, length);
+        init_serial_known = length > 0;
+    }
+    init_cache_slot = maxCachedAdapters;
+    //Without a serial number every adapter of the model would match
+    if(!init_cache_enabled || !init_serial_known) return;
+    for(uint8_t i = 0; i < maxCachedAdapters; i++) {
+        const adapterCache_t &entry = adapter_cache[i];
+        if(entry.valid && entry.idVendor == dev->idVendor && entry.idProduct == dev->idProduct && entry.serial == init_serial) {
+            memcpy(PHYAddressReg, entry.PHYAddress, sizeof(PHYAddressReg));
+            init_cache_slot = i;
+            println("Init (asix): cached setup from slot ", i, DEC);
             return;
-            //    }
+        }
+    }
+}
+
+void ASIXEthernetBase::init_cache_update() {
+    uint32_t duration = init_times[INIT_READY] - init_times[INIT_CLAIM];
+    if(init_cache_slot < maxCachedAdapters) {
+        init_fast_micros = duration;
+        //The node ID register is still read, a different MAC means the
+        //serial number wasn't unique so stop trusting the entry
+        adapterCache_t &entry = adapter_cache[init_cache_slot];
+        if(memcmp(entry.nodeID, nodeID, 6) != 0) {
+            println("Init (asix): cached adapter MAC changed, dropping slot ", init_cache_slot, DEC);
+            entry.valid = false;
+        }
+        return;
     }
-        println("Done");
+    init_full_micros = duration;
+    if(!init_cache_enabled || !init_serial_known || !control_device) return;
+    adapterCache_t &entry = adapter_cache[adapter_cache_next];
+    adapter_cache_next = (adapter_cache_next + 1) % maxCachedAdapters;
+    entry.idVendor = control_device->idVendor;
+    entry.idProduct = control_device->idProduct;
+    entry.serial = init_serial;
+    memcpy(entry.nodeID, nodeID, 6);
+    memcpy(entry.PHYAddress, PHYAddressReg, sizeof(PHYAddressReg));
+    entry.valid = true;
 }
 
-void ASIXEthernet::rx_callback(const Transfer_t *transfer) {
+void ASIXEthernetBase::rx_callback(const Transfer_t *transfer) {
 //    println("rx_callback(asix)");
     if (transfer->driver) {
 //        print("transfer->qtd.token = ");
 //        println(transfer->qtd.token & 255);
-        ((ASIXEthernet *)(transfer->driver))->rx_data(transfer);
+        ((ASIXEthernetBase *)(transfer->driver))->rx_data(transfer);
     }
 }
 
-void ASIXEthernet::tx_callback(const Transfer_t *transfer) {
+void ASIXEthernetBase::tx_callback(const Transfer_t *transfer) {
 //    println("tx_callback(asix)");
     if (transfer->driver) {
 //        print("transfer->qtd.token = ");
 //        println(transfer->qtd.token & 255);
-        ((ASIXEthernet *)(transfer->driver))->tx_data(transfer);
+        ((ASIXEthernetBase *)(transfer->driver))->tx_data(transfer);
     }
 }
 
-void ASIXEthernet::interrupt_callback(const Transfer_t *transfer) {
+void ASIXEthernetBase::interrupt_callback(const Transfer_t *transfer) {
 //    println("interrupt_callback(asix)");
     if (transfer->driver) {
 //        print("transfer->qtd.token = ");
 //        println(transfer->qtd.token & 255);
-        ((ASIXEthernet *)(transfer->driver))->interrupt_data(transfer);
+        ((ASIXEthernetBase *)(transfer->driver))->interrupt_data(transfer);
     }
 }
 
-void ASIXEthernet::disconnect() {
+void ASIXEthernetBase::disconnect() {
     rxpipe = NULL;
     txpipe = NULL;
     interruptpipe = NULL;
     connected = 0;
+    pending_control = 0;
+    control_queued = false;
+    control_request_active = false;
+    control_count = 0;
+    rx_mode_writes = 0;
+    control_script = NULL;
+    control_device = NULL;
+    rx_packet_queued = 0;
+    //Frames retained from before the disconnect stay valid until released
+    for(uint8_t i = 0; i < num_rx_buffers; i++) {
+        rx_buffer_state[i].state = rx_buffer_state[i].loans ? RX_LOANED : RX_FREE;
+    }
+    rx_ring_head = 0;
+    rx_ring_tail = 0;
+    rx_offset = 0;
+    rx_carry_length = 0;
+    rx_polling = (rx_mode == RX_POLLED);
+    tx_packet_queued = 0;
+    tx_open_buffer = NULL;
+    tx_open_length = 0;
+    tx_slots_used = 0;
+    tx_slot_tail = current_tx_buffer;
+    for(uint8_t i = 0; i < num_tx_buffers; i++) tx_slot_pending[i] = 0;
+    if(link_up) {
+        link_up = false;
+        if(handleLinkChange) (*handleLinkChange)(false, false, false);
+    }
     println("Device Disconnected...");
 }
 
-void ASIXEthernet::rx_data(const Transfer_t *transfer) {
+void ASIXEthernetBase::rx_data(const Transfer_t *transfer) {
     //Current header format is: bytes 0-1 = Packet Length LSB-MSB
     //Current header format is: bytes 2-3 = One's Complement Packet Length LSB-MSB
     //Current header format is: bytes 4-5 = Packet Type information and checksum error detected
@@ -664,120 +535,827 @@ void ASIXEthernet::rx_data(const Transfer_t *transfer) {
     uint32_t len = transfer->length - ((transfer->qtd.token >> 16) & 0x7FFF);
 //    if(len > 1000) println("rx_data(asix): ", len, DEC);
 //    if(len > 1000) print_hexbytes((uint8_t*)transfer->buffer, len);
-//    println("queue another receive packet");
-    rx_buffer = (uint8_t*)rx_buffer0 + (current_rx_buffer * transferSize);
-    if(current_rx_buffer == (num_rx_buffers - 1)) current_rx_buffer = 0;
-    else current_rx_buffer++;
-    
+    uint8_t index = ((uint8_t*)transfer->buffer - (uint8_t*)rx_buffer0) / transferSize;
+    rx_buffer_state[index].state = RX_HELD;
+    rx_buffer_state[index].length = len;
     rx_packet_queued--;
-    queue_Data_Transfer(rxpipe, rx_buffer, transferSize, this);
-    rx_packet_queued++;
+    rx_window_transfers++;
+    rx_window_bytes += len;
+    //Full when another copy of its largest frame wouldn't have fitted, so
+    //the adapter may have had to hold the next frame back
+    if(rx_adaptive && len + ASIXFraming::rxHeaderSize + ASIXFraming::largestFrame((uint8_t*)transfer->buffer, len) > rx_aggregation_size) {
+        rx_window_full++;
+    }
+    ASIX_STAT(stats.rxTransfers++);
     
-    (*handleRecieve)((uint8_t*)transfer->buffer, len);
+    //Keep handing buffers to read() until it has caught up so frames stay
+    //in order when polling stops
+    if(rx_since_read < 255) rx_since_read++;
+    if(rx_mode == RX_ADAPTIVE && rx_since_read >= rxPollTransfers) rx_polling = true;
+    if(rx_polling || rx_ring_head != rx_ring_tail) {
+        uint8_t tail = rx_ring_tail;
+        rx_ring[tail] = index;
+        rx_ring_tail = (tail == num_rx_buffers) ? 0 : tail + 1;
+        return;
+    }
+    //The other buffers in the ring stay queued while this one is handed
+    //to the consumer, it only goes back to the hardware once released
+    uint32_t bytes = 0;
+    rx_process(index, 0, 0, bytes);
+    rx_offset = 0;
+    rx_release(index);
+}
+
+uint32_t ASIXEthernetBase::rx_process(uint8_t index, uint32_t frameBudget, uint32_t byteBudget, uint32_t &bytes) {
+    //Carries on from rx_offset, which is left at the end of the transfer
+    //once every frame in it has been handled
+    uint8_t *buffer = (uint8_t*)rx_buffer0 + (index * transferSize);
+    uint32_t length = rx_buffer_state[index].length;
+    rx_current = index;
+    if(handleRecieveFrame || ethertype_count) {
+        uint32_t frames = rx_frames(buffer, length, frameBudget, byteBudget, bytes);
+        rx_current = 0xFF;
+        return frames;
+    }
+    rx_offset = length;
+    if(!handleRecieve) {
+        rx_current = 0xFF;
+        return 0;
+    }
+    rx_current_data = buffer;
+    rx_current_length = length;
+    (*handleRecieve)(buffer, length);
+    rx_current = 0xFF;
+    bytes += length;
+    return 1;
+}
+
+void ASIXEthernetBase::rx_queue(uint8_t index) {
+    if(!rxpipe || rx_buffer_state[index].state != RX_FREE) return;
+    if(rx_hold()) return; //Re-armed by read() once the ring drains
+    if(queue_Data_Transfer(rxpipe, (uint8_t*)rx_buffer0 + (index * transferSize), transferSize, this)) {
+        rx_buffer_state[index].state = RX_QUEUED;
+        rx_packet_queued++;
+    }
 }
 
-void ASIXEthernet::tx_data(const Transfer_t *transfer) {
+bool ASIXEthernetBase::rx_hold() {
+    //Called with the USB interrupt masked or from it
+    bool hold = false;
+    if(rx_backpressure) {
+        uint8_t waiting = (rx_ring_tail + num_rx_buffers + 1 - rx_ring_head) % (num_rx_buffers + 1);
+        hold = waiting >= rx_backpressure;
+    }
+    if(hold != rx_backpressured) {
+        rx_backpressured = hold;
+        if(hold) {
+            rx_backpressure_start = micros();
+            ASIX_STAT(stats.rxHeldBackEvents++);
+        }
+        else {
+            ASIX_STAT(stats.rxHeldBackMicros += micros() - rx_backpressure_start);
+        }
+    }
+    return hold;
+}
+
+void ASIXEthernetBase::rx_release(uint8_t index) {
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    if(rx_buffer_state[index].loans) {
+        rx_buffer_state[index].state = RX_LOANED;
+    }
+    else {
+        rx_buffer_state[index].state = RX_FREE;
+        rx_queue(index);
+    }
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+}
+
+bool ASIXEthernetBase::retainFrame(frameHandle_t &frame) {
+    if(rx_current >= num_rx_buffers) return false; //Only inside a recieve callback
+    frame.data = rx_current_data;
+    frame.length = rx_current_length;
+    frame.info = rx_frame_info;
+    frame.buffer = rx_current;
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    rx_buffer_state[rx_current].loans++;
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+    return true;
+}
+
+void ASIXEthernetBase::releaseFrame(frameHandle_t &frame) {
+    if(frame.buffer >= num_rx_buffers) return;
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    rxBuffer_t &buffer = rx_buffer_state[frame.buffer];
+    if(buffer.loans && --buffer.loans == 0 && buffer.state == RX_LOANED) {
+        buffer.state = RX_FREE;
+        rx_queue(frame.buffer);
+    }
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+    frame.buffer = 0xFF;
+}
+
+uint32_t ASIXEthernetBase::rx_frames(const uint8_t *data, uint32_t length, uint32_t frameBudget, uint32_t byteBudget, uint32_t &bytes) {
+    ASIXFraming::rxFrame_t frame;
+    uint32_t frames = 0;
+    uint32_t start = bytes;
+    if(rx_offset == 0) {
+        rx_transfer_frames = 0;
+        if(rx_carry_length) rx_offset = rx_carry_finish(data, length, frames, bytes);
+    }
+    for(;;) {
+        if(frameBudget && frames >= frameBudget) return frames;
+        if(byteBudget && bytes - start >= byteBudget) return frames;
+        uint8_t result = ASIXFraming::nextFrame(data, length, rx_offset, frame);
+        if(result != ASIXFraming::RX_END && frame.skipped > ASIXFraming::rxMaxPadding) {
+            println("rx_frames(asix): resync, skipped ", frame.skipped, DEC);
+            ASIX_STAT(stats.rxResyncErrors++);
+        }
+        if(result != ASIXFraming::RX_FRAME) {
+            //Only a transfer that filled the whole queued buffer was cut
+            //off by the host, so whatever is left is the start of a frame
+            //continued in the next transfer. A shorter one was ended by
+            //the adapter even when it is a multiple of the packet size
+            uint32_t left = length - rx_offset;
+            if(left && length == transferSize && left <= sizeof(rx_carry)) {
+                memcpy(rx_carry, data + rx_offset, left);
+                rx_carry_length = left;
+            }
+            else if(result == ASIXFraming::RX_PARTIAL) {
+                println("rx_frames(asix): truncated frame ", frame.length, DEC);
+                ASIX_STAT(stats.rxTruncatedFrames++);
+            }
+            break;
+        }
+        rx_deliver(frame.data, frame.length, frame.flags);
+        frames++;
+        bytes += frame.length;
+    }
+    rx_offset = length;
+    ASIX_STAT(if(rx_transfer_frames > stats.rxMaxFramesPerTransfer) stats.rxMaxFramesPerTransfer = rx_transfer_frames);
+    return frames;
+}
+
+uint32_t ASIXEthernetBase::rx_carry_finish(const uint8_t *data, uint32_t length, uint32_t &frames, uint32_t &bytes) {
+    //Completes the frame carried over from the last transfer and returns
+    //where the next header starts, the carried bytes are dropped if they
+    //turn out to be padding or the frame doesn't fit
+    uint32_t used = 0;
+    if(rx_carry_length < ASIXFraming::rxHeaderSize) {
+        used = ASIXFraming::rxHeaderSize - rx_carry_length;
+        if(used > length) {
+            rx_carry_length = 0;
+            return 0;
+        }
+        memcpy(rx_carry + rx_carry_length, data, used);
+        rx_carry_length = ASIXFraming::rxHeaderSize;
+        if(!ASIXFraming::rxHeaderValid(rx_carry)) {
+            rx_carry_length = 0;
+            return 0;
+        }
+    }
+    uint16_t frameLength = (rx_carry[0] | (rx_carry[1] << 8)) & 0x7FF;
+    uint32_t needed = ASIXFraming::rxHeaderSize + frameLength - rx_carry_length;
+    if(used + needed > length) {
+        println("rx_frames(asix): truncated frame ", frameLength, DEC);
+        ASIX_STAT(stats.rxTruncatedFrames++);
+        rx_carry_length = 0;
+        return 0;
+    }
+    memcpy(rx_carry + rx_carry_length, data + used, needed);
+    rx_carry_length = 0;
+    ASIX_STAT(stats.rxSplitFrames++);
+    //Not in a recieve buffer so it can't be retained
+    uint8_t current = rx_current;
+    rx_current = 0xFF;
+    rx_deliver(rx_carry + ASIXFraming::rxHeaderSize, frameLength, rx_carry[4] | (rx_carry[5] << 8));
+    rx_current = current;
+    frames++;
+    bytes += frameLength;
+    //Transfers start 2 byte aligned in the stream so the next header is
+    //on an even offset
+    return (used + needed + 1) & ~1;
+}
+
+void ASIXEthernetBase::rx_deliver(const uint8_t *data, uint16_t length, uint16_t flags) {
+    rx_transfer_frames++;
+    uint8_t type = flags >> 8;
+    rx_frame_info.flags = flags;
+    rx_frame_info.l4ChecksumError = type & 0x01;
+    rx_frame_info.l3ChecksumError = type & 0x02;
+    rx_frame_info.l4Type = (type >> 2) & 0x07;
+    rx_frame_info.l3Type = (type >> 5) & 0x03;
+    ASIX_STAT(stats.rxFrames++);
+    ASIX_STAT(stats.rxBytes += length);
+    ASIX_STAT(if(type & 0x03) stats.rxChecksumErrors++);
+    if((filter_count || filter_default != FILTER_ACCEPT) && !filter_accept(data, length)) {
+        ASIX_STAT(stats.rxFilteredFrames++);
+        return;
+    }
+    rx_current_data = data;
+    rx_current_length = length;
+    frameHandler_t handler = ethertype_count ? ethertype_lookup(data) : handleRecieveFrame;
+    if(handler) (*handler)(data, length);
+}
+
+bool ASIXEthernetBase::filter_accept(const uint8_t *frame, uint16_t length) {
+    for(uint8_t i = 0; i < filter_count; i++) {
+        filterRule_t &rule = filter_rules[i];
+        if(rule.offset + 4 > length) continue;
+        const uint8_t *p = frame + rule.offset;
+        uint32_t word = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        if((word & rule.mask) != rule.value) continue;
+        rule.hits++;
+        return rule.action == FILTER_ACCEPT;
+    }
+    return filter_default == FILTER_ACCEPT;
+}
+
+int8_t ASIXEthernetBase::addFilterRule(uint16_t offset, uint32_t mask, uint32_t value, uint8_t action) {
+    if(filter_count >= maxFilterRules) return -1;
+    //A raw transfer holds several frames so it can't be filtered
+    if(handleRecieve && !handleRecieveFrame && !ethertype_count) return -1;
+    filterRule_t &rule = filter_rules[filter_count];
+    rule.offset = offset;
+    rule.action = action;
+    rule.mask = mask;
+    rule.value = value & mask;
+    rule.hits = 0;
+    //Only counted once the rule is filled in, the interrupt reads up to filter_count
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    filter_count++;
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+    return filter_count - 1;
+}
+
+void ASIXEthernetBase::clearFilterRules() {
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    filter_count = 0;
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+}
+
+void ASIXEthernetBase::setFilterDefault(uint8_t action) {
+    filter_default = action;
+}
+
+ASIXEthernetBase::frameHandler_t ASIXEthernetBase::ethertype_lookup(const uint8_t *frame) {
+    //A handler for the exact destination wins over one for any destination
+    uint16_t etherType = (frame[12] << 8) | frame[13];
+    frameHandler_t handler = handleRecieveFrame;
+    uint8_t slot = ethertype_hash(etherType);
+    for(uint8_t n = 0; n < maxEtherTypeHandlers; n++, slot = (slot + 1) & (maxEtherTypeHandlers - 1)) {
+        const etherTypeHandler_t &entry = ethertype_handlers[slot];
+        if(entry.state == ETHERTYPE_EMPTY) break;
+        if(entry.state != ETHERTYPE_USED || entry.etherType != etherType) continue;
+        if(!entry.anyDestination) {
+            if(memcmp(entry.destination, frame, 6) == 0) return entry.handler;
+        }
+        else handler = entry.handler;
+    }
+    return handler;
+}
+
+bool ASIXEthernetBase::setHandleEtherType(uint16_t etherType, frameHandler_t fptr, const uint8_t *destination) {
+    int8_t free = -1;
+    uint8_t slot = ethertype_hash(etherType);
+    for(uint8_t n = 0; n < maxEtherTypeHandlers; n++, slot = (slot + 1) & (maxEtherTypeHandlers - 1)) {
+        etherTypeHandler_t &entry = ethertype_handlers[slot];
+        if(entry.state != ETHERTYPE_USED) {
+            if(free < 0) free = slot;
+            if(entry.state == ETHERTYPE_EMPTY) break;
+            continue;
+        }
+        if(entry.etherType != etherType || entry.anyDestination != !destination) continue;
+        if(destination && memcmp(entry.destination, destination, 6) != 0) continue;
+        NVIC_DISABLE_IRQ(IRQ_USBHS);
+        if(fptr) {
+            entry.handler = fptr;
+        }
+        else {
+            entry.state = ETHERTYPE_DELETED;   //Keeps the probe chain intact
+            ethertype_count--;
+        }
+        NVIC_ENABLE_IRQ(IRQ_USBHS);
+        return true;
+    }
+    if(!fptr) return true;
+    if(free < 0) return false;
+    etherTypeHandler_t &entry = ethertype_handlers[free];
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    entry.etherType = etherType;
+    entry.anyDestination = !destination;
+    if(destination) memcpy(entry.destination, destination, 6);
+    entry.handler = fptr;
+    entry.state = ETHERTYPE_USED;
+    ethertype_count++;
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+    return true;
+}
+
+void ASIXEthernetBase::tx_data(const Transfer_t *transfer) {
 //    uint32_t len = transfer->length - ((transfer->qtd.token >> 16) & 0x7FFF);
 //    if(len > 1000) println("tx_data(asix): ", len, DEC);
 //    print_hexbytes((uint8_t*)transfer->buffer, len);
     tx_packet_queued--;
+    tx_slot_pending[((uint8_t*)transfer->buffer - (uint8_t*)tx_buffer0) / transmitSize]--;
+    tx_advance();
 }
 
-void ASIXEthernet::interrupt_data(const Transfer_t *transfer) {
+void ASIXEthernetBase::interrupt_data(const Transfer_t *transfer) {
 //    uint32_t len = transfer->length - ((transfer->qtd.token >> 16) & 0x7FFF);
     const uint8_t *p = (const uint8_t *)transfer->buffer;
+    bool up = p[2] & 0x01;
     PHYSpeed = (p[2] & 0x10) ? 1 : 0;
-    if(((p[2] & 0x1) ? 1 : 0) == 1 && pending_control == 255) {
-        pending_control = 48;
-        mk_setup(setup, 0x40, 6, 0x0000, 0, 0);
-        queue_Control_Transfer(device, &setup, NULL, this);
-        control_queued = true;
-        pending_control = 49;
+    if(up && !link_up) {
+        //A script that is already running reaches linkScript by itself
+        link_up = true;
+        ASIX_STAT(stats.linkUps++);
+        if(pending_control == 254 || pending_control == 255) {
+            control_start(linkScript, sizeof(linkScript)/sizeof(initStep_t));
+        }
     }
-    else if(((p[2] & 0x1) ? 1 : 0) == 0 && pending_control == 254) {
-        pending_control = 255;
-        connected = false;
+    else if(!up && link_up) {
+        link_up = false;
+        ASIX_STAT(stats.linkDowns++);
+        if(pending_control == 254) {
+            pending_control = 255;
+            connected = false;
+        }
+        if(handleLinkChange) (*handleLinkChange)(false, false, false);
     }
 //    println("interrupt_data(asix): ", len, DEC);
 //    print_hexbytes((uint8_t*)transfer->buffer, (len < 32)? len : 32 );
     queue_Data_Transfer(interruptpipe, interrupt_buffer, interrupt_size, this);
 }
 
-bool ASIXEthernet::read() {
-    if(!rxpipe) return false;
-    if(pending_control != 254) return false;
-    if (!rx_packet_queued && rxpipe) {
+uint32_t ASIXEthernetBase::read(uint32_t frameBudget, uint32_t byteBudget, bool *more) {
+    uint32_t frames = 0;
+    uint32_t bytes = 0;
+    if(more) *more = false;
+    if(!rxpipe) return 0;
+    rx_since_read = 0;
+    //Deferred transfers are handled here, the head only moves on once the
+    //callbacks are done so the interrupt keeps deferring until then
+    while(rx_ring_head != rx_ring_tail) {
+        if((frameBudget && frames >= frameBudget) || (byteBudget && bytes >= byteBudget)) break;
+        uint8_t head = rx_ring_head;
+        uint8_t index = rx_ring[head];
+        frames += rx_process(index, frameBudget ? frameBudget - frames : 0, byteBudget ? byteBudget - bytes : 0, bytes);
+        if(rx_offset < rx_buffer_state[index].length) break; //Out of budget part way through
+        rx_offset = 0;
+        rx_ring_head = (head == num_rx_buffers) ? 0 : head + 1;
+        rx_release(index);
+    }
+    bool pending = rx_ring_head != rx_ring_tail;
+    if(more) *more = pending;
+    //Caught up, go back to handling transfers in the interrupt. Anything
+    //that arrives meanwhile is still deferred until the ring is empty
+    if(!pending && rx_mode == RX_ADAPTIVE) rx_polling = false;
+    
+    if(pending_control != 254) return frames;
+    if (rx_packet_queued < num_rx_buffers) { //Re-arm any buffers that failed to queue
         NVIC_DISABLE_IRQ(IRQ_USBHS);
-        
-        rx_buffer = (uint8_t*)rx_buffer0 + (current_rx_buffer * transferSize);
-        if(current_rx_buffer == (num_rx_buffers - 1)) current_rx_buffer = 0;
-        else current_rx_buffer++;
-        
-        queue_Data_Transfer(rxpipe, rx_buffer, transferSize, this);
+        for(uint8_t i = 0; i < num_rx_buffers; i++) {
+            if(rx_buffer_state[i].state == RX_FREE) rx_queue(i);
+        }
         NVIC_ENABLE_IRQ(IRQ_USBHS);
-        rx_packet_queued++;
     }
+    if(tx_open_buffer && (micros() - tx_open_time) >= tx_coalesce_timeout) flushTx();
+    if(rx_adaptive) aggregation_update();
+    return frames;
+}
+
+void ASIXEthernetBase::getStatistics(statistics_t &copy) {
+#if ASIXETHERNET_STATISTICS
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    copy = stats;
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+#else
+    memset(&copy, 0, sizeof(copy));
+#endif
+}
+
+void ASIXEthernetBase::clearStatistics() {
+#if ASIXETHERNET_STATISTICS
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    memset(&stats, 0, sizeof(stats));
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+#endif
+}
+
+void ASIXEthernetBase::setAdaptiveAggregation(bool enable) {
+    rx_adaptive = enable;
+    rx_aggregation_votes = 0;
+    rx_window_start = micros();
+    rx_aggregation_size = aggregationSize();
+    if(!enable) aggregation_set(aggregationLevel(transferSize)); //Back to the largest size that fits
+}
+
+uint32_t ASIXEthernetBase::aggregationSize() {
+    for(uint8_t i = 0; i < numAggregationLevels; i++) {
+        if(aggregationLevels[i].wValue == rx_aggregation[0]) return aggregationLevels[i].size;
+    }
+    return 0;
+}
+
+void ASIXEthernetBase::aggregation_update() {
+    uint32_t now = micros();
+    if(now - rx_window_start < aggregationWindow) return;
+    rx_window_start = now;
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    uint32_t transfers = rx_window_transfers;
+    uint32_t full = rx_window_full;
+    uint32_t bytes = rx_window_bytes;
+    rx_window_transfers = 0;
+    rx_window_full = 0;
+    rx_window_bytes = 0;
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+    
+    uint32_t size = aggregationSize();
+    uint8_t level = aggregationLevel(size);
+    //Growing needs both load, enough transfers a window, and most of them
+    //full. A few full size frames a window fill 2k transfers one at a time
+    //without any backlog. Averaging under a quarter full with none full
+    //means they are completing on the timeout. Frames are only walked for
+    //their lengths so this works the same when transfers aren't deframed
+    if(transfers >= aggregationBusyTransfers && full * 2 > transfers) {
+        if(rx_aggregation_votes < 0) rx_aggregation_votes = 0;
+        rx_aggregation_votes++;
+    }
+    else if(!transfers || (!full && bytes / transfers < size / 4)) {
+        if(rx_aggregation_votes > 0) rx_aggregation_votes = 0;
+        rx_aggregation_votes--;
+    }
+    else {
+        rx_aggregation_votes = 0;
+    }
+    
+    if(rx_aggregation_votes >= aggregationUpWindows) {
+        if(level + 1 < numAggregationLevels && aggregationLevels[level + 1].size <= transferSize) aggregation_set(level + 1);
+        rx_aggregation_votes = 0;
+    }
+    else if(rx_aggregation_votes <= aggregationDownWindows) {
+        if(level) aggregation_set(level - 1);
+        rx_aggregation_votes = 0;
+    }
+}
+
+bool ASIXEthernetBase::aggregation_set(uint8_t level) {
+    if(aggregationLevels[level].wValue == rx_aggregation[0]) return true;
+    if(pending_control == 254 || pending_control == 255) {
+        if(!controlRequest(0x40, 42, aggregationLevels[level].wValue, aggregationLevels[level].wIndex, 0)) return false;
+    }
+    //Otherwise the link script writes it
+    rx_aggregation[0] = aggregationLevels[level].wValue;
+    rx_aggregation[1] = aggregationLevels[level].wIndex;
+    rx_aggregation_size = aggregationLevels[level].size;
+    rx_aggregation_changes++;
+    println("Aggregation size: ", aggregationLevels[level].size, DEC);
     return true;
 }
 
-void ASIXEthernet::sendPacket(const uint8_t *data, uint32_t length) {
-    if (!txpipe) return;
-    if(pending_control != 254) return;
+void ASIXEthernetBase::sendPacket(const uint8_t *data, uint32_t length) {
+    fragment_t fragment = {data, length};
+    sendPacket(&fragment, 1);
+}
+
+void ASIXEthernetBase::sendPacket(const fragment_t *fragments, uint8_t count) {
+    tx_append(fragments, count, true);
+}
+
+uint8_t ASIXEthernetBase::trySend(const uint8_t *data, uint32_t length) {
+    fragment_t fragment = {data, length};
+    return trySend(&fragment, 1);
+}
+
+uint8_t ASIXEthernetBase::trySend(const fragment_t *fragments, uint8_t count) {
+    return tx_append(fragments, count, false);
+}
+
+uint8_t* ASIXEthernetBase::acquireTxBuffer() {
+    uint8_t *payload;
+    while(!(payload = tryAcquireTxBuffer())) {
+        if (!txpipe || pending_control != 254) return NULL;
+        ASIX_STAT(uint32_t start = micros());
+        if(handleWait) (*handleWait)();
+        ASIX_STAT(stats.txWaitMicros += micros() - start);
+    }
+    return payload;
+}
+
+uint8_t* ASIXEthernetBase::tryAcquireTxBuffer() {
+    if (!txpipe) return NULL;
+    if(pending_control != 254) return NULL;
+    flushTx(); //Keep frames in order
     
-    tx_buffer = (uint8_t*)tx_buffer0 + (current_tx_buffer * transmitSize);
-    if(current_tx_buffer == (num_tx_buffers - 1)) current_tx_buffer = 0;
-    else current_tx_buffer++;
-
-    //Insert USB Header to data message
-    //This is the default format and the most basic
-    //it can be changed to an alternate format
-    //but this is the simplest one that works fine
-    tx_buffer[0] = length & 0x00FF;     //Length of packet LSB
-    tx_buffer[1] = (length >> 8) & 0x7; //Length of packet MSB
-    tx_buffer[2] = ~length & 0x00FF;                //One's complement Length of packet LSB
-    tx_buffer[3] = 0xF0 | ((~length >> 8) & 0x7);   //One's complement Length of packet MSB
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    if(tx_slots_used >= num_tx_buffers) {
+        tx_space_wanted = true;
+        NVIC_ENABLE_IRQ(IRQ_USBHS);
+        return NULL;
+    }
+    //Picked and advanced under the mask too, handleTxSpace may send from
+    //the interrupt and must get the next buffer rather than this one
+    uint8_t slot = current_tx_buffer;
+    tx_slot_pending[slot] = 1; //Held until committed
+    tx_slots_used++;
+    if(slot == (num_tx_buffers - 1)) current_tx_buffer = 0;
+    else current_tx_buffer = slot + 1;
+    ASIX_STAT(if(tx_slots_used > stats.txBuffersHighWater) stats.txBuffersHighWater = tx_slots_used);
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+    return (uint8_t*)tx_buffer0 + (slot * transmitSize) + txHeaderSize;
+}
+
+uint8_t ASIXEthernetBase::commitTxBuffer(uint8_t *payload, uint32_t length) {
+    //The slot comes from the pointer, like tx_queue, so a send made between
+    //acquiring and committing a buffer can't commit the wrong one
+    if(!payload) return TX_NOT_CONNECTED;
+    uint8_t *buffer = payload - txHeaderSize;
+    if(buffer < (uint8_t*)tx_buffer0 || buffer >= (uint8_t*)tx_buffer0 + num_tx_buffers * transmitSize) return TX_NOT_CONNECTED;
+    if((buffer - (uint8_t*)tx_buffer0) % transmitSize) return TX_NOT_CONNECTED;
+    uint8_t result = TX_SENT;
+    if(length > txBufferSize()) result = TX_TOO_LONG;
+    else if(!txpipe) result = TX_NOT_CONNECTED;
+    else {
+        ASIX_STAT(stats.txFrames++);
+        ASIX_STAT(stats.txBytes += length);
+        ASIXFraming::txHeader(buffer, length);
+        tx_queue(buffer, length + txHeaderSize);
+    }
+    tx_release(buffer);
+    return result;
+}
+
+uint8_t ASIXEthernetBase::sendPackets(const uint8_t* const* data, const uint32_t* lengths, uint8_t count) {
+    uint8_t result = TX_SENT;
+    uint32_t threshold = tx_coalesce_threshold;
+    tx_coalesce_threshold = transmitSize; //Pack until full, flushed below
+    for(uint8_t i = 0; i < count; i++) {
+        fragment_t fragment = {data[i], lengths[i]};
+        uint8_t sent = tx_append(&fragment, 1, true);
+        if(result == TX_SENT) result = sent;
+    }
+    tx_coalesce_threshold = threshold;
+    flushTx();
+    return result;
+}
+
+void ASIXEthernetBase::setTxCoalescing(uint32_t threshold, uint32_t timeout) {
+    if(threshold > transmitSize - txHeaderSize) threshold = transmitSize - txHeaderSize;
+    tx_coalesce_threshold = threshold;
+    tx_coalesce_timeout = timeout;
+    if(!threshold) flushTx();
+}
+
+void ASIXEthernetBase::flushTx() {
+    if(!tx_open_buffer) return;
+    uint8_t *buffer = tx_open_buffer;
+    tx_open_buffer = NULL;
+    if(txpipe) tx_queue(buffer, tx_open_length);
+    tx_open_length = 0;
+    tx_release(buffer);
+}
+
+uint8_t ASIXEthernetBase::tx_append(const fragment_t *fragments, uint8_t count, bool wait) {
+    if (!txpipe || pending_control != 254) return TX_NOT_CONNECTED;
+    uint32_t length = 0;
+    for(uint8_t i = 0; i < count; i++) length += fragments[i].length;
+    if(length > txBufferSize()) return TX_TOO_LONG;
     
-    for(uint16_t i = 0; i < length; i++) {
-        tx_buffer[i + 4] = *data++;
+    //Packed frames start on a 2 byte boundary and 4 bytes are kept spare
+    //at the end in case tx_queue has to add a padding header
+    uint32_t start = (tx_open_length + 1) & ~1;
+    if(!tx_coalesce_threshold || txHeaderSize + length > transmitSize - txHeaderSize) {
+        uint8_t *payload = wait ? acquireTxBuffer() : tryAcquireTxBuffer();
+        if(!payload) return (txpipe && pending_control == 254) ? TX_BUSY : TX_NOT_CONNECTED;
+        ASIXFraming::gather(payload, fragments, count);
+        return commitTxBuffer(payload, length);
     }
-    if(length < 64) {   //Add padding bytes for small messages
-        for(uint16_t i = length + 4; i < 64 + 4; i++) {
-            tx_buffer[i] = 0;
-        }
-        length = 64;
+    if(tx_open_buffer && start + txHeaderSize + length > transmitSize - txHeaderSize) {
+        flushTx();
+        start = 0;
     }
-    length += 4; //Add header size
-    uint16_t _index = 0;
-    while(length > transmitSize) { //Send chunks if large message
-        queue_Data_Transfer(txpipe, tx_buffer + _index, transmitSize, this);
-        tx_packet_queued++;
-        length -= transmitSize;
-        _index += transmitSize;
+    if(!tx_open_buffer) {
+        uint8_t *payload = wait ? acquireTxBuffer() : tryAcquireTxBuffer();
+        if(!payload) return (txpipe && pending_control == 254) ? TX_BUSY : TX_NOT_CONNECTED;
+        tx_open_buffer = payload - txHeaderSize;
+        tx_open_time = micros();
+        start = 0;
     }
-    if(length){
-        queue_Data_Transfer(txpipe, tx_buffer + _index, length, this);
+    else if(start > tx_open_length) tx_open_buffer[tx_open_length] = 0;
+    
+    ASIXFraming::txHeader(tx_open_buffer + start, length);
+    ASIXFraming::gather(tx_open_buffer + start + txHeaderSize, fragments, count);
+    tx_open_length = start + txHeaderSize + length;
+    ASIX_STAT(stats.txFrames++);
+    ASIX_STAT(stats.txBytes += length);
+    if(tx_open_length >= tx_coalesce_threshold) flushTx();
+    return TX_SENT;
+}
+
+void ASIXEthernetBase::tx_queue(uint8_t *buffer, uint32_t length) {
+    uint8_t slot = (buffer - (uint8_t*)tx_buffer0) / transmitSize;
+    length = ASIXFraming::padTransfer(buffer, length, tx_size);
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    if(queue_Data_Transfer(txpipe, buffer, length, this)) {
+        tx_slot_pending[slot]++;
         tx_packet_queued++;
+        ASIX_STAT(stats.txTransfers++);
     }
-    while(tx_packet_queued >= num_tx_buffers) {
-        (*handleWait)();
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+}
+
+void ASIXEthernetBase::tx_release(uint8_t *buffer) {
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    tx_slot_pending[(buffer - (uint8_t*)tx_buffer0) / transmitSize]--;
+    tx_advance();
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+}
+
+void ASIXEthernetBase::tx_advance() {
+    //Buffers are handed out in order so only free them in order, a buffer
+    //is free once it is committed and all of its transfers have completed
+    bool freed = false;
+    while(tx_slots_used && tx_slot_pending[tx_slot_tail] == 0) {
+        if(tx_slot_tail == (num_tx_buffers - 1)) tx_slot_tail = 0;
+        else tx_slot_tail++;
+        tx_slots_used--;
+        freed = true;
+    }
+    if(freed && tx_space_wanted && handleTxSpace) {
+        tx_space_wanted = false;
+        (*handleTxSpace)();
+    }
+}
+
+bool ASIXEthernetBase::controlRequest(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                                  uint16_t wLength, const uint8_t *data, uint8_t *result,
+                                  void (*callback)(void *context, const uint8_t *data, uint16_t length),
+                                  void *context) {
+    if(wLength > sizeof(control_requests[0].data)) return false;
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    if(control_count >= maxControlRequests) {
+        NVIC_ENABLE_IRQ(IRQ_USBHS);
+        return false;
     }
+    control_push(bmRequestType, bRequest, wValue, wIndex, wLength, data, result, callback, context);
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+    return true;
 }
 
-void ASIXEthernet::readPHY(uint32_t address, uint16_t *data) {
-    mk_setup(setup, 0xc0, 7, 0x0010, address, 2);
-    queue_Control_Transfer(device, &setup, (uint8_t*)data, this);
+void ASIXEthernetBase::control_push(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                                    uint16_t wLength, const uint8_t *data, uint8_t *result,
+                                    void (*callback)(void *context, const uint8_t *data, uint16_t length),
+                                    void *context) {
+    //Called with the USB interrupt masked once the caller has checked for
+    //space, so several requests can go in under one mask
+    controlRequest_t &request = control_requests[(control_head + control_count) % maxControlRequests];
+    mk_setup(request.setup, bmRequestType, bRequest, wValue, wIndex, wLength);
+    if(data && !(bmRequestType & 0x80)) memcpy(request.data, data, wLength);
+    request.result = result;
+    request.callback = callback;
+    request.context = context;
+    control_count++;
+    control_next();
+}
+
+void ASIXEthernetBase::control_next() {
+    //Requests wait for init or a link change to finish using the control pipe
+    if(control_queued || !control_count || !control_device) return;
+    if(pending_control != 254 && pending_control != 255) return;
+    controlRequest_t &request = control_requests[control_head];
+    queue_Control_Transfer(control_device, &request.setup, (request.setup.wLength ? request.data : NULL), this);
     control_queued = true;
+    control_request_active = true;
 }
 
-void ASIXEthernet::writePHY(uint32_t address, uint16_t data) {
-    mk_setup(setup, 0x40, 8, 0x0010, address, 2);
+void ASIXEthernetBase::control_complete() {
+    //Copied out before the slot is freed, the callback may queue a request
+    //into it while still reading the data
+    controlRequest_t request = control_requests[control_head];
+    if(request.result && (request.setup.bmRequestType & 0x80)) memcpy(request.result, request.data, request.setup.wLength);
+    if(control_head == (maxControlRequests - 1)) control_head = 0;
+    else control_head++;
+    control_count--;
+    if(request.callback) (*request.callback)(request.context, request.data, request.setup.wLength);
+}
+
+bool ASIXEthernetBase::readPHY(uint32_t address, uint16_t *data,
+                               void (*callback)(void *context, const uint8_t *data, uint16_t length), void *context) {
+    //PHY access needs ownership of the station management interface, all
+    //three requests go in under one mask so ownership is always released
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    bool queued = (maxControlRequests - control_count) >= 3;
+    if(queued) {
+        control_push(0x40, 6, 0x0000, 0, 0, NULL, NULL, NULL, NULL);   //Request Ownership
+        control_push(0xc0, 7, PHYAddressReg[1], address, 2, NULL, (uint8_t*)data, callback, context);
+        control_push(0x40, 10, 0x0000, 0, 0, NULL, NULL, NULL, NULL);  //Release Ownership
+    }
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+    return queued;
+}
+
+bool ASIXEthernetBase::writePHY(uint32_t address, uint16_t data,
+                                void (*callback)(void *context, const uint8_t *data, uint16_t length), void *context) {
     uint8_t xfr[2] = {(uint8_t)(data & 0xFF), (uint8_t)((data >> 8) & 0xFF)};
-    queue_Control_Transfer(device, &setup, xfr, this);
-    control_queued = true;
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    bool queued = (maxControlRequests - control_count) >= 3;
+    if(queued) {
+        control_push(0x40, 6, 0x0000, 0, 0, NULL, NULL, NULL, NULL);   //Request Ownership
+        control_push(0x40, 8, PHYAddressReg[1], address, 2, xfr, NULL, callback, context);
+        control_push(0x40, 10, 0x0000, 0, 0, NULL, NULL, NULL, NULL);  //Release Ownership
+    }
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+    return queued;
 }
 
-void ASIXEthernet::setMulticast(uint8_t *hashTable) {
-    mk_setup(setup, 0x40, 22, 0x0000, 0, 8);
-    queue_Control_Transfer(device, &setup, hashTable, this);
-    control_queued = true;
+bool ASIXEthernetBase::setRxMode(uint8_t mode) {
+    if(!control_device) {
+        rx_mode_wanted = mode;
+        return true;
+    }
+    //Only wanted once the write is queued, under one mask so the
+    //completion can't run between queuing and counting it
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    bool queued = control_count < maxControlRequests;
+    if(queued) {
+        rx_mode_wanted = mode;
+        rx_mode_writes++;
+        control_push(0x40, 16, rx_control(mode, rxControlBase), 0, 0, NULL, NULL, rx_mode_written, this);
+    }
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+    return queued;
+}
+
+void ASIXEthernetBase::rx_mode_written(void *context, const uint8_t *data, uint16_t length) {
+    //Writes complete in order, only the last one leaves the wanted mode set
+    ASIXEthernetBase *asix = (ASIXEthernetBase *)context;
+    if(asix->rx_mode_writes && --asix->rx_mode_writes == 0) asix->rx_mode_confirmed = asix->rx_mode_wanted;
+}
+
+uint16_t ASIXEthernetBase::rx_control(uint8_t mode, uint16_t value) {
+    //RX Control register filter bits, the rest of value is kept
+    value &= ~0x001B;
+    if(mode & RX_MODE_PROMISCUOUS) value |= 0x0001;
+    if(mode & RX_MODE_ALLMULTI) value |= 0x0002;
+    if(mode & RX_MODE_BROADCAST) value |= 0x0008;
+    if(mode & RX_MODE_MULTICAST) value |= 0x0010;   //Filtered by the hash table
+    return value;
+}
+
+bool ASIXEthernetBase::setMulticast(uint8_t *hashTable) {
+    return controlRequest(0x40, 22, 0x0000, 0, 8, hashTable);
 }
+
+bool ASIXEthernetBase::joinMulticast(const uint8_t *address) {
+    int8_t empty = -1;
+    for(uint8_t i = 0; i < maxMulticastGroups; i++) {
+        if(multicast_groups[i].refs && memcmp(multicast_groups[i].address, address, 6) == 0) {
+            if(multicast_groups[i].refs == 255) return false;
+            multicast_groups[i].refs++;
+            return true;
+        }
+        if(!multicast_groups[i].refs && empty < 0) empty = i;
+    }
+    if(empty < 0) return false;
+    memcpy(multicast_groups[empty].address, address, 6);
+    multicast_groups[empty].refs = 1;
+    if(!multicast_update()) {
+        multicast_groups[empty].refs = 0;
+        return false;
+    }
+    return true;
+}
+
+bool ASIXEthernetBase::leaveMulticast(const uint8_t *address) {
+    for(uint8_t i = 0; i < maxMulticastGroups; i++) {
+        if(multicast_groups[i].refs && memcmp(multicast_groups[i].address, address, 6) == 0) {
+            if(--multicast_groups[i].refs == 0 && !multicast_update()) {
+                multicast_groups[i].refs = 1;
+                return false;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ASIXEthernetBase::multicast_update() {
+    //Each group sets one bit in the 64 bit hash table, the bit number is
+    //the top 6 bits of the big endian ethernet CRC of the address
+    uint8_t table[8] = {0,0,0,0,0,0,0,0};
+    for(uint8_t i = 0; i < maxMulticastGroups; i++) {
+        if(!multicast_groups[i].refs) continue;
+        uint8_t bit = ASIXFraming::etherCrc(multicast_groups[i].address, 6) >> 26;
+        table[bit >> 3] |= 1 << (bit & 7);
+    }
+    if(memcmp(table, multicastTable, sizeof(table)) == 0) return true;
+    //Only kept once the write is queued, a table the adapter never got
+    //would otherwise match the next update and never be written
+    if(pending_control == 254 || pending_control == 255) { //Otherwise written when the link comes up
+        if(!setMulticast(table)) return false;
+    }
+    memcpy(multicastTable, table, sizeof(table));
+    return true;
+}
+
@@ -25,32 +25,273 @@
 #define ASIXEthernet_h
 
 #include "USBHost_t36.h"
+#include "ASIXFraming.h"
+
+//Set to 0 to compile out the driver statistics counters
+#ifndef ASIXETHERNET_STATISTICS
+#define ASIXETHERNET_STATISTICS 1
+#endif
+
+#if ASIXETHERNET_STATISTICS
+#define ASIX_STAT(x) x
+#else
+#define ASIX_STAT(x)
+#endif
 
 //--------------------------------------------------------------------------
-class ASIXEthernet : public USBDriver {
+//Driver logic, buffer geometry and storage come from ASIXEthernetT below
+class ASIXEthernetBase : public USBDriver {
 public:
-    ASIXEthernet(USBHost &host) { init(); }
-    ASIXEthernet(USBHost *host) { init(); }
-    bool read();
+    bool read() {
+        read(0);
+        return rxpipe && pending_control == 254;
+    }
+    //Handles at most frameBudget frames and byteBudget bytes of deferred
+    //recieve traffic (0 is no limit) and returns the number of frames.
+    //more is set when frames are still waiting for the next call. With
+    //setHandleRecieve each transfer counts as one frame
+    uint32_t read(uint32_t frameBudget, uint32_t byteBudget = 0, bool *more = NULL);
+    bool rxPending() {return rx_ring_head != rx_ring_tail;}
+    //Frames shorter than the 60 byte minimum are padded by the adapter, the
+    //USB header carries the length so the driver sends them as they are
     void sendPacket(const uint8_t* data, uint32_t length);
+    //Gathers a frame from several pieces straight into the transmit buffer
+    typedef ASIXFraming::fragment_t fragment_t;
+    void sendPacket(const fragment_t* fragments, uint8_t count);
+    enum {TX_SENT, TX_BUSY, TX_NOT_CONNECTED, TX_TOO_LONG};
+    //Never waits, returns TX_BUSY when every transmit buffer is in flight
+    uint8_t trySend(const uint8_t* data, uint32_t length);
+    uint8_t trySend(const fragment_t* fragments, uint8_t count);
+    //Called from the USB interrupt when a transmit buffer frees up after
+    //a send returned TX_BUSY
+    void setHandleTxSpace(void (*fptr)()) {
+        handleTxSpace = fptr;
+    }
+    //Returns the payload area of the next transmit buffer with room for
+    //txBufferSize() bytes, build the frame in place then commitTxBuffer
+    //writes the USB header and queues it, NULL if not connected
+    uint8_t* acquireTxBuffer();
+    uint8_t* tryAcquireTxBuffer(); //Same as acquireTxBuffer but NULL if none are free
+    //Takes the pointer acquireTxBuffer returned, other sends may happen
+    //between the two calls. The buffer is released whatever it returns,
+    //TX_TOO_LONG past txBufferSize() or TX_NOT_CONNECTED
+    uint8_t commitTxBuffer(uint8_t *payload, uint32_t length);
+    uint32_t txBufferSize() {return txMaxFrameSize;}
+    //Packs the frames back to back into as few bulk transfers as possible,
+    //a frame that can't be sent is skipped and the first failure returned
+    uint8_t sendPackets(const uint8_t* const* data, const uint32_t* lengths, uint8_t count);
+    //When threshold is non zero sendPacket packs frames into one transfer
+    //until it holds threshold bytes or the oldest frame has waited timeout
+    //microseconds, the timeout is checked in read()
+    void setTxCoalescing(uint32_t threshold, uint32_t timeout);
+    void flushTx();
     void setHandleRecieve(void (*fptr)(const uint8_t* data, uint32_t length)) {
         handleRecieve = fptr;
     }
+    //Called once per ethernet frame found in a recieve transfer, takes
+    //priority over setHandleRecieve which is passed the raw transfer
+    //without the packet filter
+    void setHandleRecieveFrame(void (*fptr)(const uint8_t* data, uint32_t length)) {
+        handleRecieveFrame = fptr;
+    }
+    //Frames of one EtherType go to their own callback instead of the
+    //recieve frame callback, when destination is given only frames sent
+    //to that address do. NULL removes it, false when the table is full
+    typedef void (*frameHandler_t)(const uint8_t* data, uint32_t length);
+    bool setHandleEtherType(uint16_t etherType, frameHandler_t fptr, const uint8_t *destination = NULL);
+    //RX_INTERRUPT calls the recieve callbacks from the USB interrupt.
+    //RX_POLLED only hands finished transfers to read() which then calls
+    //the callbacks. RX_ADAPTIVE switches to polled when transfers come in
+    //faster than read() is called and back once read() catches up
+    enum {RX_INTERRUPT, RX_POLLED, RX_ADAPTIVE};
+    void setRecieveMode(uint8_t mode) {
+        rx_mode = mode;
+        rx_polling = (mode == RX_POLLED);
+    }
+    //While threshold or more transfers are waiting for read() recieve
+    //buffers aren't given back to the adapter, so its own buffer fills
+    //and, with flow control negotiated, it pauses the link partner at its
+    //default watermarks. Only transfers deferred to read() count, 0 turns
+    //it off
+    void setRxBackpressure(uint8_t threshold) {
+        rx_backpressure = threshold;
+    }
+    //Checksum offload results from the recieve header (bytes 4-5) of the
+    //frame currently being passed to the recieve frame callback
+    enum {L3_OTHER, L3_IPV4, L3_IPV6};
+    enum {L4_OTHER, L4_UDP, L4_ICMP, L4_IGMP, L4_TCP};
+    struct frameInfo_t {
+        uint8_t l3Type;
+        uint8_t l4Type;
+        bool l3ChecksumError;
+        bool l4ChecksumError;
+        uint16_t flags;     //Raw bytes 4-5
+        //True when the hardware verified every checksum in the frame
+        //and the stack doesn't need to check them again
+        bool checksumVerified() const {
+            return l3Type == L3_IPV4 && !l3ChecksumError &&
+                (l4Type == L4_TCP || l4Type == L4_UDP) && !l4ChecksumError;
+        }
+    };
+    const frameInfo_t& frameInfo() {return rx_frame_info;}
+    //Called from a recieve callback, keeps the current frame (or transfer
+    //with setHandleRecieve) in place after the callback returns instead of
+    //copying it. The recieve buffer holding it goes back to the adapter
+    //once every frame retained from it is released, so frames held for a
+    //long time take recieve buffers out of use
+    struct frameHandle_t {
+        const uint8_t *data;
+        uint32_t length;
+        frameInfo_t info;
+        uint8_t buffer;
+    };
+    //Returns false for a frame joined from two transfers, copy it instead
+    bool retainFrame(frameHandle_t &frame);
+    void releaseFrame(frameHandle_t &frame);
+    //Transmit checksum insertion is enabled during init, the adapter fills
+    //in the IPv4 header, TCP and UDP checksums so the stack can leave
+    //those fields as zero instead of calculating them
+    static const bool txChecksumOffload = true;
+    //Which frames the adapter passes on, can be changed at any time. The
+    //RX Control register is rewritten through the control request queue
+    //and rxMode() changes once the write completes, false if the queue
+    //is full. Before the adapter is claimed it is used by bring-up
+    enum {RX_MODE_BROADCAST = 0x01, RX_MODE_MULTICAST = 0x02, RX_MODE_ALLMULTI = 0x04, RX_MODE_PROMISCUOUS = 0x08};
+    bool setRxMode(uint8_t mode);
+    uint8_t rxMode() {return rx_mode_confirmed;}
+    bool rxModePending() {return rx_mode_confirmed != rx_mode_wanted || rx_mode_writes;}
     void setPacketTypePromiscuous() {
-        PACKET_TYPE_PROMISCUOUS = true;
+        setRxMode(RX_MODE_BROADCAST | RX_MODE_PROMISCUOUS);
     }
+    //Checked against each recieved frame before any callback, the first
+    //rule whose 4 bytes at offset (big endian) masked equal value decides
+    //and frames no rule matches get the default action. A frame too short
+    //for a rule doesn't match it. addFilterRule returns the rule number
+    //for filterHits, -1 when all maxFilterRules are used or when only
+    //setHandleRecieve is set. Rules only see deframed frames, transfers
+    //passed whole to setHandleRecieve are never filtered
+    enum {FILTER_ACCEPT, FILTER_DROP};
+    static const uint8_t maxFilterRules = 16;
+    int8_t addFilterRule(uint16_t offset, uint32_t mask, uint32_t value, uint8_t action);
+    void clearFilterRules();
+    void setFilterDefault(uint8_t action);
+    uint32_t filterHits(uint8_t rule) {return rule < filter_count ? filter_rules[rule].hits : 0;}
     void setHandleWait(void (*fptr)()) {
         handleWait = fptr;
     }
-    void readPHY(uint32_t address, uint16_t *data);
-    void writePHY(uint32_t address, uint16_t data);
-    void setMulticast(uint8_t *hashTable);
+    //Register access is queued and sent one after another once init is
+    //done, the setup and data are copied so nothing has to stay in scope.
+    //Data read back is copied to result and then callback is called from
+    //the USB interrupt, false is returned if the queue is full
+    bool controlRequest(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                        uint16_t wLength, const uint8_t *data = NULL, uint8_t *result = NULL,
+                        void (*callback)(void *context, const uint8_t *data, uint16_t length) = NULL,
+                        void *context = NULL);
+    bool controlIdle() {return !control_count;}
+    //PHY register access, callback is called from the USB interrupt once
+    //the read or write itself completes, with the two bytes read
+    bool readPHY(uint32_t address, uint16_t *data,
+                 void (*callback)(void *context, const uint8_t *data, uint16_t length) = NULL, void *context = NULL);
+    bool writePHY(uint32_t address, uint16_t data,
+                  void (*callback)(void *context, const uint8_t *data, uint16_t length) = NULL, void *context = NULL);
+    bool setMulticast(uint8_t *hashTable);
+    //Reference counted multicast groups, the hash table is calculated from
+    //the joined groups and written to the Multicast Filter Array Register.
+    //False with nothing changed when that write can't be queued
+    bool joinMulticast(const uint8_t *address);
+    bool leaveMulticast(const uint8_t *address);
     uint8_t nodeID[6]; //Also known as MAC address
     uint8_t txQueued() {return tx_packet_queued;}
+    struct statistics_t {
+        uint32_t rxFrames;
+        uint32_t rxBytes;
+        uint32_t rxTransfers;
+        uint32_t rxMaxFramesPerTransfer;
+        uint32_t rxResyncErrors;        //Corrupt recieve headers skipped over
+        uint32_t rxTruncatedFrames;     //Frames running past the end of a transfer
+        uint32_t rxSplitFrames;         //Frames joined back together across two transfers
+        uint32_t rxChecksumErrors;      //Frames with a hardware L3 or L4 checksum error
+        uint32_t rxFilteredFrames;      //Frames dropped by the packet filter
+        uint32_t rxHeldBackEvents;      //Times the driver held its recieve buffers back, not pause frames
+        uint32_t rxHeldBackMicros;      //Time the driver spent holding them back
+        uint32_t txFrames;
+        uint32_t txBytes;
+        uint32_t txTransfers;
+        uint32_t txBuffersHighWater;    //Most transmit buffers in use at once
+        uint32_t txWaitMicros;          //Time spent calling handleWait for a free buffer
+        uint32_t controlRetries;        //Init verify steps that read back the wrong value
+        uint32_t linkUps;
+        uint32_t linkDowns;
+    };
+    //Copies the counters, all zero if ASIXETHERNET_STATISTICS is 0
+    void getStatistics(statistics_t &stats);
+    void clearStatistics();
+    //Runs the register reads that are only useful for debugging during init
+    void setInitDiagnostics(bool enable) {
+        init_diagnostics = enable;
+    }
+    //micros() at the start of each init phase, INIT_LINK and INIT_READY
+    //are updated each time the link comes up
+    enum {INIT_CLAIM, INIT_MAC, INIT_PHY_RESET, INIT_PHY_SETUP, INIT_RX_SETUP, INIT_LINK, INIT_READY, INIT_PHASES};
+    uint32_t initTime(uint8_t phase) {return init_times[phase];}
+    //Setup read from an adapter (MAC, PHY address) is kept so plugging the
+    //same adapter back in skips the SROM reads and most of the PHY reset
+    //pulses, adapters without a serial number are never cached. Durations
+    //are claim to ready in microseconds, 0 until used
+    void setInitCache(bool enable) {
+        init_cache_enabled = enable;
+    }
+    bool fastInit() {return init_cache_slot < maxCachedAdapters;}
+    uint32_t fullInitMicros() {return init_full_micros;}
+    uint32_t fastInitMicros() {return init_fast_micros;}
     volatile bool initialized;
     volatile bool connected;
     volatile bool PHYSpeed;
+    //Called from the USB interrupt when the link goes down and once the
+    //medium mode is set up after it comes back, so the stack can restart
+    //ARP and DHCP straight away
+    void setHandleLinkChange(void (*fptr)(bool up, bool speed100, bool fullDuplex)) {
+        handleLinkChange = fptr;
+    }
+    bool linkUp() {return link_up;}
+    bool fullDuplex() {return link_full_duplex;}
+    //PHY register 05h read when the link last came up, 0 if the partner
+    //didn't autonegotiate
+    uint16_t linkPartnerAbility() {return link_partner[0] | (link_partner[1] << 8);}
+    //Bulk in aggregation register values for a recieve buffer size, picks
+    //the largest documented setting in aggregationLevels that fits
+    static constexpr uint8_t aggregationLevel(uint32_t size, uint8_t level = 0) {
+        return (level + 1 < numAggregationLevels && aggregationLevels[level + 1].size <= size) ?
+               aggregationLevel(size, level + 1) : level;
+    }
+    static constexpr uint16_t aggregationValue(uint32_t size) {return aggregationLevels[aggregationLevel(size)].wValue;}
+    static constexpr uint16_t aggregationIndex(uint32_t size) {return aggregationLevels[aggregationLevel(size)].wIndex;}
+    //Steps the bulk in aggregation size between 2k and RX_SIZE from read(),
+    //smaller when transfers complete mostly empty so they aren't held back
+    //waiting to fill, larger under load when most have no room left for
+    //another of their largest frame. Works with setHandleRecieve too as
+    //frames are only walked for their lengths
+    void setAdaptiveAggregation(bool enable);
+    uint32_t aggregationSize();
+    uint32_t aggregationChanges() {return rx_aggregation_changes;}
+    static const uint8_t txHeaderSize = ASIXFraming::txHeaderSize;
+    static const uint16_t txMaxFrameSize = ASIXFraming::txMaxFrameSize;
 protected:
+    struct rxBuffer_t {
+        volatile uint8_t state;
+        volatile uint32_t length;   //Bytes recieved while held
+        volatile uint16_t loans;    //Frames retained by the application
+    };
+    //rxRing needs room for rxCount + 1 buffer numbers
+    ASIXEthernetBase(volatile uint8_t *rxBuffers, uint32_t rxSize, uint8_t rxCount, rxBuffer_t *rxState, volatile uint8_t *rxRing,
+                     volatile uint8_t *txBuffers, uint32_t txSize, uint8_t txCount, volatile uint8_t *txState,
+                     Transfer_t *transfers, uint32_t transferCount) :
+        transferSize(rxSize), transmitSize(txSize), num_rx_buffers(rxCount), num_tx_buffers(txCount),
+        rx_buffer_state(rxState), rx_buffer0(rxBuffers), rx_ring(rxRing), tx_slot_pending(txState), tx_buffer0(txBuffers),
+        mytransfers(transfers), num_transfers(transferCount) {
+        rx_aggregation[0] = aggregationValue(rxSize);
+        rx_aggregation[1] = aggregationIndex(rxSize);
+    }
     virtual bool claim(Device_t *device, int type, const uint8_t *descriptors, uint32_t len);
     virtual void control(const Transfer_t *transfer);
     virtual void disconnect();
@@ -60,10 +301,37 @@ protected:
     void rx_data(const Transfer_t *transfer);
     void tx_data(const Transfer_t *transfer);
     void interrupt_data(const Transfer_t *transfer);
+    uint32_t rx_frames(const uint8_t *data, uint32_t length, uint32_t frameBudget, uint32_t byteBudget, uint32_t &bytes);
+    uint32_t rx_process(uint8_t index, uint32_t frameBudget, uint32_t byteBudget, uint32_t &bytes);
+    uint32_t rx_carry_finish(const uint8_t *data, uint32_t length, uint32_t &frames, uint32_t &bytes);
+    void rx_deliver(const uint8_t *data, uint16_t length, uint16_t flags);
+    frameHandler_t ethertype_lookup(const uint8_t *frame);
+    bool filter_accept(const uint8_t *frame, uint16_t length);
+    bool multicast_update();   //False when the table changed but its write couldn't be queued
+    void control_run();
+    void control_next();
+    void control_complete();
+    void control_push(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                      uint16_t wLength, const uint8_t *data, uint8_t *result,
+                      void (*callback)(void *context, const uint8_t *data, uint16_t length), void *context);
+    void rx_queue(uint8_t index);
+    bool rx_hold();
+    void rx_release(uint8_t index);
+    void aggregation_update();
+    bool aggregation_set(uint8_t level);
+    uint8_t tx_append(const fragment_t *fragments, uint8_t count, bool wait);
+    void tx_queue(uint8_t *buffer, uint32_t length);
+    void tx_release(uint8_t *buffer);
+    void tx_advance();
     void init();
 private:
     
-    bool PACKET_TYPE_PROMISCUOUS = false;
+    volatile uint8_t rx_mode_wanted = RX_MODE_BROADCAST | RX_MODE_MULTICAST;
+    volatile uint8_t rx_mode_confirmed = 0;
+    volatile uint8_t rx_mode_writes = 0;        //RX Control writes queued or in flight
+    static const uint16_t rxControlBase = 0x03C0;    //Last bring-up RX Control value without the filter bits
+    static uint16_t rx_control(uint8_t mode, uint16_t value);
+    static void rx_mode_written(void *context, const uint8_t *data, uint16_t length);
     
     uint32_t rx_size;
     uint32_t tx_size;
@@ -77,40 +345,266 @@ private:
     uint16_t rx_interval = 0;
     uint16_t tx_interval = 0;
     uint16_t interrupt_interval = 0;
-    uint8_t rx_packet_queued;
-    uint8_t tx_packet_queued;
+    volatile uint8_t rx_packet_queued;
+    frameInfo_t rx_frame_info;
+#if ASIXETHERNET_STATISTICS
+    statistics_t stats;
+#endif
+    volatile uint8_t tx_packet_queued;
     bool interrupt_packet_queued;
     bool control_queued;
     uint8_t pending_control;
     
-    uint8_t owner[2];
     uint8_t verify[8];
     uint8_t interface;
-    uint8_t PHYAddressReg[2] = {0xE0, 0x10};
+    uint8_t PHYAddressReg[2] = {0xE0, 0x10};  //Register 25, byte 1 is the internal PHY used for every PHY request
+    
+    static const uint8_t maxMulticastGroups = 16;
+    struct {
+        uint8_t address[6];
+        uint8_t refs;
+    } multicast_groups[maxMulticastGroups];
+    
+    //Open addressed on the EtherType, entries for one EtherType with and
+    //without a destination share a probe chain
+    static const uint8_t maxEtherTypeHandlers = 16;    //Power of 2
+    enum {ETHERTYPE_EMPTY, ETHERTYPE_USED, ETHERTYPE_DELETED};
+    struct etherTypeHandler_t {
+        uint8_t state;
+        bool anyDestination;
+        uint16_t etherType;
+        uint8_t destination[6];
+        frameHandler_t handler;
+    } ethertype_handlers[maxEtherTypeHandlers];
+    uint8_t ethertype_count = 0;
+    
+    struct filterRule_t {
+        uint16_t offset;
+        uint8_t action;
+        uint32_t mask;
+        uint32_t value;     //Already masked
+        volatile uint32_t hits;
+    } filter_rules[maxFilterRules];
+    volatile uint8_t filter_count = 0;
+    uint8_t filter_default = FILTER_ACCEPT;
+    static uint8_t ethertype_hash(uint16_t etherType) {
+        return (etherType ^ (etherType >> 4) ^ (etherType >> 8)) & (maxEtherTypeHandlers - 1);
+    }
+    uint8_t multicastTable[8];
     
     setup_t setup;
     uint8_t setupdata[16];
-    static const uint32_t transferSize = 1024 * 16; //Change recieve buffer size
-    static const uint32_t transmitSize = 1518;  //Change transmit buffer size
-                                       //1518 is the max size message that can be sent
     
-    volatile uint8_t current_rx_buffer = 0;
-    static const uint8_t num_rx_buffers = 1; //Number of recieve buffers
-    uint8_t* rx_buffer;
-    volatile uint8_t rx_buffer0[transferSize * num_rx_buffers];
+    enum {BUF_NONE, BUF_SCRATCH, BUF_VERIFY, BUF_NODEID, BUF_PHYADDR, BUF_MULTICAST, BUF_DATA, BUF_LINK};
+    enum {
+        STEP_DIAGNOSTIC = 0x01,     //Only read for debugging
+        STEP_VERIFY = 0x02,         //Check (verify[0] & mask) == check, otherwise go back to retry
+        STEP_RXCTL = 0x04,          //Filter bits of wValue from the RX mode
+        STEP_AGGREGATION = 0x08,    //wValue/wIndex from rx_aggregation
+        STEP_MULTICAST = 0x10,      //Skipped if no multicast groups are joined
+        STEP_MEDIUM = 0x20,         //wValue from medium_mode
+        STEP_CACHED = 0x40,         //Skipped when the adapter's setup is cached
+        STEP_PHY = 0x80,            //wValue is the PHY address from PHYAddressReg
+    };
+    struct initStep_t {
+        uint8_t bmRequestType;
+        uint8_t bRequest;
+        uint16_t wValue;
+        uint16_t wIndex;
+        uint8_t length;
+        uint8_t buffer;     //Where data is read to or written from
+        uint16_t data;      //Write data for BUF_DATA, offset for BUF_NODEID
+        uint8_t flags;
+        uint8_t mask;
+        uint8_t check;
+        uint8_t retry;
+        uint8_t phase;      //Timestamped when this step starts
+    };
+    void control_start(const initStep_t *script, uint8_t length);
+    static const initStep_t initScript[];
+    static const initStep_t linkScript[];
+    static const uint8_t maxInitRetries = 8;
+    static const uint16_t phyAdvertisement = 0x05E1;   //Pause, 100 full/half, 10 full/half, 802.3
+    static const uint16_t mediumModeDefault = 0x0336;  //100M, full duplex, flow control
+    uint16_t medium_mode();
+    void init_cache_lookup(Device_t *dev);
+    void init_cache_update();
+    static const uint8_t maxCachedAdapters = 4;
+    struct adapterCache_t {
+        bool valid;
+        uint16_t idVendor;
+        uint16_t idProduct;
+        uint32_t serial;        //CRC of the serial number string
+        uint8_t nodeID[6];
+        uint8_t PHYAddress[2];
+    };
+    static adapterCache_t adapter_cache[maxCachedAdapters]; //Shared by every driver instance
+    static uint8_t adapter_cache_next;
+    bool init_cache_enabled = true;
+    uint8_t init_cache_slot = maxCachedAdapters;
+    uint32_t init_serial = 0;
+    bool init_serial_known = false; //Adapters without a serial number aren't cached
+    bool init_pending = false;      //Claimed but not ready yet
+    uint32_t init_full_micros = 0;
+    uint32_t init_fast_micros = 0;
+    volatile bool link_up = false;
+    bool link_full_duplex = true;
+    uint8_t link_partner[2] = {0, 0};
+    const initStep_t *control_script = NULL;
+    uint8_t control_script_length = 0;
+    uint8_t control_step = 0;
+    uint8_t control_retries = 0;
+    Device_t *control_device = NULL;
+    bool init_diagnostics = false;
+    uint32_t init_times[INIT_PHASES];
+    uint16_t rx_aggregation[2]; //Bulk in aggregation, derived from transferSize
+    struct aggregationLevel_t {
+        uint32_t size;
+        uint16_t wValue;
+        uint16_t wIndex;
+    };
+    //Documented bulk in aggregation settings, smallest first
+    static const uint8_t numAggregationLevels = 6;
+    static constexpr aggregationLevel_t aggregationLevels[numAggregationLevels] = {
+        {1024 * 2,  0x8000, 0x8001},
+        {1024 * 4,  0x8100, 0x8147},
+        {1024 * 8,  0x8300, 0x83D7},
+        {1024 * 16, 0x8400, 0x851E},
+        {1024 * 24, 0x8600, 0x87AE},
+        {1024 * 32, 0x8700, 0x8A3D},
+    };
+    static const uint32_t aggregationWindow = 100000;    //Microseconds between adjustments
+    static const int8_t aggregationUpWindows = 1;        //Windows in a row before growing
+    static const int8_t aggregationDownWindows = -4;     //Windows in a row before shrinking
+    static const uint32_t aggregationBusyTransfers = 100;  //Transfers in a window before growing
+    bool rx_adaptive = false;
+    int8_t rx_aggregation_votes = 0;
+    uint32_t rx_aggregation_changes = 0;
+    uint32_t rx_window_start = 0;
+    volatile uint32_t rx_window_transfers = 0;
+    volatile uint32_t rx_window_full = 0;   //Transfers with no room for another of their largest frame
+    volatile uint32_t rx_window_bytes = 0;
+    uint32_t rx_aggregation_size = 0;
+    
+    static const uint8_t maxControlRequests = 8;
+    struct controlRequest_t {
+        setup_t setup;
+        uint8_t data[8];
+        uint8_t *result;
+        void (*callback)(void *context, const uint8_t *data, uint16_t length);
+        void *context;
+    } control_requests[maxControlRequests];
+    volatile uint8_t control_head = 0;
+    volatile uint8_t control_count = 0;
+    volatile bool control_request_active = false;
+    const uint32_t transferSize;                 //Recieve buffer size
+    const uint32_t transmitSize;                 //Transmit buffer size
+    const uint8_t num_rx_buffers;                //Number of recieve buffers kept queued
+    const uint8_t num_tx_buffers;                //Number of transmit buffers
+    
+    enum {RX_FREE, RX_QUEUED, RX_HELD, RX_LOANED}; //Loaned is done with by the driver but has retained frames
+    rxBuffer_t *rx_buffer_state;
+    volatile uint8_t *rx_buffer0;
+    //Held buffers waiting for read() in deferred mode, only the interrupt
+    //moves the tail and only read() moves the head. A buffer is in the
+    //ring at most once so it never fills
+    volatile uint8_t *rx_ring;
+    volatile uint8_t rx_ring_head = 0;
+    volatile uint8_t rx_ring_tail = 0;
+    uint32_t rx_offset = 0;             //Progress through the buffer being handled
+    uint32_t rx_transfer_frames = 0;
+    //Start of a frame cut off at the end of the last transfer
+    uint8_t rx_carry[ASIXFraming::rxHeaderSize + ASIXFraming::rxMaxFrameSize];
+    uint16_t rx_carry_length = 0;
+    uint8_t rx_current = 0xFF;          //Buffer of the frame being passed to a callback
+    const uint8_t *rx_current_data;
+    uint32_t rx_current_length;
+    uint8_t rx_mode = RX_INTERRUPT;
+    volatile bool rx_polling = false;   //Deferring to read()
+    volatile uint8_t rx_since_read = 0; //Transfers finished since the last read()
+    static const uint8_t rxPollTransfers = 2; //Adaptive mode starts deferring at this many
+    uint8_t rx_backpressure = 0;
+    bool rx_backpressured = false;
+    uint32_t rx_backpressure_start = 0;
     
     volatile uint8_t current_tx_buffer = 0;
-    static const uint8_t num_tx_buffers = 32; //Number of transmit buffers
-    uint8_t* tx_buffer;
-    volatile uint8_t tx_buffer0[transmitSize * num_tx_buffers];
+    volatile uint8_t *tx_slot_pending; //Transfers in flight plus one while held
+    volatile uint8_t tx_slots_used = 0;
+    volatile uint8_t tx_slot_tail = 0;
+    volatile bool tx_space_wanted = false;
+    uint8_t* tx_open_buffer;        //Transmit buffer frames are being packed into
+    uint32_t tx_open_length;
+    uint32_t tx_open_time;
+    uint32_t tx_coalesce_threshold = 0;
+    uint32_t tx_coalesce_timeout = 0;
+    volatile uint8_t *tx_buffer0;
     
     uint8_t interrupt_buffer[8];
     
     Pipe_t mypipes[4] __attribute__ ((aligned(32)));
-    Transfer_t mytransfers[134] __attribute__ ((aligned(32)));
+    Transfer_t *mytransfers;
+    uint32_t num_transfers;
     strbuf_t mystring_bufs[1];
     void (*handleRecieve)(const uint8_t *data, uint32_t length);
+    void (*handleRecieveFrame)(const uint8_t *data, uint32_t length);
     void (*handleWait)();
+    void (*handleTxSpace)();
+    void (*handleLinkChange)(bool up, bool speed100, bool fullDuplex);
+};
+
+//Recieve and transmit buffers, these can be declared separately to place
+//them in a chosen memory region, ie DMAMEM on Teensy 4
+template<uint32_t RX_SIZE, uint8_t RX_BUFFERS, uint8_t TX_BUFFERS, uint32_t TX_SIZE>
+struct ASIXEthernetBuffers {
+    volatile uint8_t rx[RX_SIZE * RX_BUFFERS] __attribute__ ((aligned(32)));
+    volatile uint8_t tx[TX_SIZE * TX_BUFFERS] __attribute__ ((aligned(32)));
+};
+
+//RX_SIZE is the size of each bulk in transfer and sets the adapter's
+//aggregation size, TX_SIZE is the size of each transmit buffer which
+//limits how many frames can be packed into one transfer. The defaults
+//take about 64k, the same as a single 16k recieve buffer did, so they
+//fit a Teensy 3.6 alongside a sketch
+template<uint32_t RX_SIZE = 1024 * 8, uint8_t RX_BUFFERS = 2, uint8_t TX_BUFFERS = 32, uint32_t TX_SIZE = 1518 + 4>
+class ASIXEthernetDriver : public ASIXEthernetBase {
+    static_assert(RX_SIZE >= 1024 * 2, "Recieve buffers must hold the smallest aggregation size");
+    static_assert(TX_SIZE >= 1518 + 4, "Transmit buffers must hold a full frame and header");
+    static_assert(RX_BUFFERS > 0 && TX_BUFFERS > 0, "At least one buffer is needed");
+public:
+    typedef ASIXEthernetBuffers<RX_SIZE, RX_BUFFERS, TX_BUFFERS, TX_SIZE> buffers_t;
+    ASIXEthernetDriver(USBHost &host, buffers_t &buffers) : ASIXEthernetBase(buffers.rx, RX_SIZE, RX_BUFFERS, rx_state, rx_ring,
+        buffers.tx, TX_SIZE, TX_BUFFERS, tx_state, transfers, sizeof(transfers)/sizeof(Transfer_t)) { init(); }
+    ASIXEthernetDriver(USBHost *host, buffers_t &buffers) : ASIXEthernetDriver(*host, buffers) {}
+private:
+    //Each queued transfer uses one Transfer_t per 16k
+    static const uint32_t rxParts = (RX_SIZE + 16383) / 16384;
+    static const uint32_t txParts = (TX_SIZE + 16383) / 16384;
+    static const uint32_t haltTransfers = 3;        //new_Pipe takes one for each of rx, tx and interrupt
+    static const uint32_t interruptTransfers = 1;
+    static const uint32_t controlTransfers = 3;     //Setup, data and status
+    //A finished transfer is only freed after its callback returns, so
+    //whatever the callback queues again needs its own until then
+    static const uint32_t callbackTransfers = rxParts > controlTransfers ? rxParts : controlTransfers;
+    static const uint32_t transferCount = RX_BUFFERS * rxParts + TX_BUFFERS * txParts + haltTransfers +
+                                          interruptTransfers + controlTransfers + callbackTransfers;
+    static_assert(transferCount >= RX_BUFFERS * rxParts + TX_BUFFERS * txParts + haltTransfers +
+                  interruptTransfers + controlTransfers + 1, "Every buffer, pipe and requeue needs a Transfer_t");
+    rxBuffer_t rx_state[RX_BUFFERS];
+    volatile uint8_t rx_ring[RX_BUFFERS + 1];
+    volatile uint8_t tx_state[TX_BUFFERS];
+    Transfer_t transfers[transferCount] __attribute__ ((aligned(32)));
 };
 
+//Driver that owns its buffers
+template<uint32_t RX_SIZE = 1024 * 8, uint8_t RX_BUFFERS = 2, uint8_t TX_BUFFERS = 32, uint32_t TX_SIZE = 1518 + 4>
+class ASIXEthernetT : public ASIXEthernetDriver<RX_SIZE, RX_BUFFERS, TX_BUFFERS, TX_SIZE> {
+public:
+    ASIXEthernetT(USBHost &host) : ASIXEthernetDriver<RX_SIZE, RX_BUFFERS, TX_BUFFERS, TX_SIZE>(host, buffers) {}
+    ASIXEthernetT(USBHost *host) : ASIXEthernetDriver<RX_SIZE, RX_BUFFERS, TX_BUFFERS, TX_SIZE>(host, buffers) {}
+private:
+    ASIXEthernetBuffers<RX_SIZE, RX_BUFFERS, TX_BUFFERS, TX_SIZE> buffers;
+};
+
+typedef ASIXEthernetT<> ASIXEthernet;
+
 #endif /* ASIXEthernet_h */
@@ -0,0 +1,99 @@
+/* ASIX AX88772 bulk endpoint framing
+ * Copyright 2019 vjmuzik (vjmuzik1@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "ASIXFraming.h"
+
+uint8_t ASIXFraming::nextFrame(const uint8_t *data, uint32_t length, uint32_t &offset, rxFrame_t &frame) {
+    frame.skipped = 0;
+    while(offset + rxHeaderSize <= length) {
+        const uint8_t *p = data + offset;
+        if(!rxHeaderValid(p)) {
+            //Not a valid header, either padding after the last frame or a
+            //corrupt header, headers are always 2 byte aligned so step
+            //forward until the next one is found
+            offset += 2;
+            frame.skipped += 2;
+            continue;
+        }
+        frame.length = (p[0] | (p[1] << 8)) & 0x7FF;
+        frame.flags = p[4] | (p[5] << 8);
+        frame.data = p + rxHeaderSize;
+        if(offset + rxHeaderSize + frame.length > length) return RX_PARTIAL;
+        offset += (rxHeaderSize + frame.length + 1) & ~1;
+        return RX_FRAME;
+    }
+    return RX_END;
+}
+
+void ASIXFraming::txHeader(uint8_t *buffer, uint32_t length) {
+    //Insert USB Header to data message
+    //This is the default format and the most basic
+    //it can be changed to an alternate format
+    //but this is the simplest one that works fine
+    buffer[0] = length & 0x00FF;     //Length of packet LSB
+    buffer[1] = (length >> 8) & 0x7; //Length of packet MSB
+    buffer[2] = ~length & 0x00FF;                //One's complement Length of packet LSB
+    buffer[3] = 0xF0 | ((~length >> 8) & 0x7);   //One's complement Length of packet MSB
+}
+
+uint16_t ASIXFraming::largestFrame(const uint8_t *data, uint32_t length) {
+    uint16_t largest = 0;
+    uint32_t offset = 0;
+    while(offset + rxHeaderSize <= length && rxHeaderValid(data + offset)) {
+        uint16_t frameLength = (data[offset] | (data[offset + 1] << 8)) & 0x7FF;
+        if(frameLength > largest) largest = frameLength;
+        offset = (offset + rxHeaderSize + frameLength + 1) & ~1;
+    }
+    return largest;
+}
+
+uint8_t* ASIXFraming::gather(uint8_t *buffer, const fragment_t *fragments, uint8_t count) {
+    for(uint8_t i = 0; i < count; i++) {
+        memcpy(buffer, fragments[i].data, fragments[i].length);
+        buffer += fragments[i].length;
+    }
+    return buffer;
+}
+
+uint32_t ASIXFraming::padTransfer(uint8_t *buffer, uint32_t length, uint32_t packetSize) {
+    if(!packetSize || (length % packetSize) != 0) return length;
+    //A transfer that is an exact multiple of the packet size would need
+    //a zero length packet to end it, add an empty header instead
+    buffer[length++] = 0x00;
+    buffer[length++] = 0x00;
+    buffer[length++] = 0xFF;
+    buffer[length++] = 0xFF;
+    return length;
+}
+
+uint32_t ASIXFraming::etherCrc(const uint8_t *data, uint8_t length) {
+    uint32_t crc = 0xFFFFFFFF;
+    while(length--) {
+        uint8_t octet = *data++;
+        for(uint8_t bit = 0; bit < 8; bit++, octet >>= 1) {
+            crc = (crc << 1) ^ ((((crc >> 31) ^ octet) & 1) ? 0x04C11DB7 : 0);
+        }
+    }
+    return crc;
+}
@@ -0,0 +1,79 @@
+/* ASIX AX88772 bulk endpoint framing
+ * Copyright 2019 vjmuzik (vjmuzik1@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ASIXFraming_h
+#define ASIXFraming_h
+
+#include <stdint.h>
+
+//Packs and unpacks the USB headers the AX88772 puts around ethernet frames
+//on the bulk endpoints. Nothing in here touches USBHost_t36 or Arduino so it
+//can be built and run on a desktop against captured or synthetic traffic
+class ASIXFraming {
+public:
+    static const uint8_t rxHeaderSize = 6;       //Length, One's complement length, Packet type/checksum
+    static const uint16_t rxMinFrameSize = 14;   //Ethernet header
+    static const uint16_t rxMaxFrameSize = 1518;
+    static const uint8_t rxMaxPadding = 6;       //Padding skipped between frames before it counts as a resync
+    static const uint8_t txHeaderSize = 4;       //Length, One's complement length
+    static const uint16_t txMaxFrameSize = 1518; //1518 is the max size message that can be sent
+    static const uint8_t txPadHeaderSize = 4;    //Empty header added by padTransfer
+    
+    struct fragment_t {
+        const uint8_t *data;
+        uint32_t length;
+    };
+    struct rxFrame_t {
+        const uint8_t *data;     //Frame without the USB header
+        uint16_t length;
+        uint16_t flags;          //Packet type/checksum word of the header
+        uint32_t skipped;        //Bytes stepped over to find the header
+    };
+    enum {RX_FRAME, RX_END, RX_PARTIAL};
+    //Finds the next frame in a bulk in transfer starting at offset, on
+    //RX_FRAME offset is moved past it. RX_PARTIAL means a valid header was
+    //found but the frame runs past length, frame.length is its full length
+    //and offset is left on the header. RX_END means no header is left
+    static uint8_t nextFrame(const uint8_t *data, uint32_t length, uint32_t &offset, rxFrame_t &frame);
+    static bool rxHeaderValid(const uint8_t *header) {
+        uint16_t frameLength = (header[0] | (header[1] << 8)) & 0x7FF;
+        uint16_t frameLengthBar = (header[2] | (header[3] << 8)) & 0x7FF;
+        return frameLength == (~frameLengthBar & 0x7FF) && frameLength >= rxMinFrameSize && frameLength <= rxMaxFrameSize;
+    }
+    
+    //Length of the longest frame in a bulk in transfer, walking the headers
+    //from the start and stopping at the first one that isn't valid
+    static uint16_t largestFrame(const uint8_t *data, uint32_t length);
+    
+    static void txHeader(uint8_t *buffer, uint32_t length);
+    //Copies the fragments back to back and returns the end of the copy
+    static uint8_t* gather(uint8_t *buffer, const fragment_t *fragments, uint8_t count);
+    //Appends an empty header when length is a multiple of packetSize so the
+    //transfer doesn't need a zero length packet, returns the new length.
+    //The buffer needs txPadHeaderSize bytes spare after length
+    static uint32_t padTransfer(uint8_t *buffer, uint32_t length, uint32_t packetSize);
+    
+    static uint32_t etherCrc(const uint8_t *data, uint8_t length);
+};
+
+#endif
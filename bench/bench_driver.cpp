@@ -0,0 +1,196 @@
+//Times the driver's recieve and transmit paths on a desktop. Traffic goes
+//through the same mock host and fake adapter as the tests, so recieve
+//includes rx_data, deframing, the packet filter, the EtherType table and
+//the statistics, and transmit includes the buffer ring and framing.
+//Recieve times include copying each burst into the transfer, which stands
+//in for the bulk in DMA, the copy row shows how much of it that is
+//
+//  asix_bench [milliseconds per row]
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ASIXEthernet.h>
+#include "FakeASIX.h"
+
+typedef ASIXEthernetT<1024 * 16, 4, 32> RxDriver;
+typedef ASIXEthernetT<1024 * 16, 4, 8, 1024 * 16> PackedDriver;
+
+static USBHost host;
+static uint32_t run_millis = 200;
+static volatile uint32_t sink;
+
+//Ethernet frame lengths without the FCS
+struct mix_t {
+    const char *name;
+    std::vector<uint16_t> lengths;
+};
+static const mix_t mixes[] = {
+    {"64 byte", {60}},
+    {"IMIX", {60, 60, 60, 60, 60, 60, 60, 590, 590, 590, 590, 1514}},
+    {"1514 byte", {1514}},
+};
+
+static void on_frame(const uint8_t *data, uint32_t length) {sink += data[length - 1];}
+
+static std::vector<Bytes> mixFrames(const mix_t &mix, uint32_t count) {
+    std::vector<Bytes> frames;
+    for(uint32_t i = 0; i < count; i++) {
+        uint16_t length = mix.lengths[i % mix.lengths.size()];
+        Bytes frame(length, 0x55);
+        memset(frame.data(), 0xFF, 6);
+        frame[12] = 0x08;
+        frame[13] = (i % 5 == 4) ? 0x06 : 0x00;   //Every fifth is ARP
+        frames.push_back(frame);
+    }
+    return frames;
+}
+
+struct result_t {
+    uint64_t frames;
+    uint64_t bytes;
+    double seconds;
+};
+
+static void report(const char *mix, const char *path, const result_t &r) {
+    printf("%-10s %-26s %9.1f ns/frame %8.1f MB/s\n", mix, path,
+           r.seconds * 1e9 / r.frames, r.bytes / r.seconds / 1e6);
+}
+
+//Repeats one round of work until run_millis have passed
+template<typename F>
+static result_t timed(F round) {
+    typedef std::chrono::steady_clock clock;
+    result_t r = {0, 0, 0};
+    auto start = clock::now();
+    auto end = start + std::chrono::milliseconds(run_millis);
+    auto now = start;
+    do {
+        round(r);
+        now = clock::now();
+    } while(now < end);
+    r.seconds = std::chrono::duration<double>(now - start).count();
+    return r;
+}
+
+enum {RX_PLAIN, RX_FILTERED, RX_POLLED};
+
+static void benchRx(const mix_t &mix, uint8_t mode) {
+    FakeASIX adapter;
+    RxDriver asix(host);
+    asix.setHandleRecieveFrame(on_frame);
+    if(mode == RX_FILTERED) {
+        //Rules that never match so every frame walks all of them
+        for(uint16_t i = 0; i < 4; i++) asix.addFilterRule(30 + i * 4, 0xFFFFFFFF, 0x0A000000 + i, ASIXEthernetBase::FILTER_DROP);
+        asix.setHandleEtherType(0x0806, on_frame);
+        asix.setHandleEtherType(0x86DD, on_frame);
+        asix.setHandleEtherType(0x88CC, on_frame);
+        asix.setHandleEtherType(0x0800, on_frame, asix.nodeID);
+    }
+    if(mode == RX_POLLED) asix.setRecieveMode(ASIXEthernetBase::RX_POLLED);
+    if(!adapter.bringUp()) {
+        printf("bring-up failed\n");
+        exit(1);
+    }
+    //One aggregated transfer worth of frames, replayed over and over
+    std::vector<Bytes> frames = mixFrames(mix, 4096);
+    Bytes burst;
+    uint32_t count = 0, bytes = 0;
+    for(const Bytes &frame : frames) {
+        if(burst.size() + ASIXFraming::rxHeaderSize + frame.size() > 1024 * 16) break;
+        FakeASIX::appendFrame(burst, frame.data(), frame.size());
+        count++;
+        bytes += frame.size();
+    }
+    result_t r = timed([&](result_t &r) {
+        for(int i = 0; i < 16; i++) {
+            adapter.queueBurst(burst);
+            adapter.pump();
+            if(mode == RX_POLLED) asix.read(0);
+            r.frames += count;
+            r.bytes += bytes;
+        }
+    });
+    ASIXEthernetBase::statistics_t stats;
+    asix.getStatistics(stats);
+    if(stats.rxFrames != r.frames) printf("  lost frames, %u of %llu\n", stats.rxFrames, (unsigned long long)r.frames);
+    static const char *names[] = {"rx frames", "rx filter+ethertype", "rx polled read()"};
+    report(mix.name, names[mode], r);
+}
+
+static void benchCopy(const mix_t &mix) {
+    std::vector<Bytes> frames = mixFrames(mix, 4096);
+    Bytes burst;
+    uint32_t count = 0, bytes = 0;
+    for(const Bytes &frame : frames) {
+        if(burst.size() + ASIXFraming::rxHeaderSize + frame.size() > 1024 * 16) break;
+        FakeASIX::appendFrame(burst, frame.data(), frame.size());
+        count++;
+        bytes += frame.size();
+    }
+    static uint8_t buffer[1024 * 16];
+    result_t r = timed([&](result_t &r) {
+        for(int i = 0; i < 16; i++) {
+            memcpy(buffer, burst.data(), burst.size());
+            sink += buffer[i];
+            r.frames += count;
+            r.bytes += bytes;
+        }
+    });
+    report(mix.name, "copy only", r);
+}
+
+template<typename Driver>
+static void benchTx(const mix_t &mix, bool packed) {
+    FakeASIX adapter;
+    adapter.unpackTx = false;
+    Driver asix(host);
+    if(!adapter.bringUp()) {
+        printf("bring-up failed\n");
+        exit(1);
+    }
+    std::vector<Bytes> frames = mixFrames(mix, 64);
+    const uint8_t *data[64];
+    uint32_t lengths[64];
+    uint32_t bytes = 0;
+    for(int i = 0; i < 64; i++) {
+        data[i] = frames[i].data();
+        lengths[i] = frames[i].size();
+        bytes += lengths[i];
+    }
+    result_t r = timed([&](result_t &r) {
+        if(packed) {
+            asix.sendPackets(data, lengths, 64);
+        }
+        else {
+            //Completes every few frames so the buffer ring keeps turning over
+            for(int i = 0; i < 64; i++) {
+                asix.sendPacket(data[i], lengths[i]);
+                if((i & 3) == 3) adapter.completeTx();
+            }
+        }
+        adapter.completeTx();
+        r.frames += 64;
+        r.bytes += bytes;
+    });
+    report(mix.name, packed ? "tx sendPackets packed" : "tx sendPacket", r);
+}
+
+int main(int argc, char **argv) {
+    if(argc > 1) run_millis = atoi(argv[1]);
+    for(const mix_t &mix : mixes) {
+        USBHost::mock_reset();
+        benchCopy(mix);
+        USBHost::mock_reset();
+        benchRx(mix, RX_PLAIN);
+        USBHost::mock_reset();
+        benchRx(mix, RX_FILTERED);
+        USBHost::mock_reset();
+        benchRx(mix, RX_POLLED);
+        USBHost::mock_reset();
+        benchTx<RxDriver>(mix, false);
+        USBHost::mock_reset();
+        benchTx<PackedDriver>(mix, true);
+    }
+    return 0;
+}
@@ -0,0 +1,135 @@
+//Times the per packet framing code on synthetic traffic, no adapter needed.
+//Results are cycles from the DWT cycle counter converted with F_CPU, run
+//it before and after a change to the framing code to catch regressions.
+
+#include <ASIXFraming.h>
+
+const uint32_t rxTransferSize = 16384;   //Default bulk in aggregation size
+const uint32_t txTransferSize = 16384;   //Packed transmit buffer
+const uint32_t packetSize = 512;         //High speed bulk packet size
+const uint32_t iterations = 200;
+
+//Ethernet frame lengths without the FCS
+const uint16_t mixSmall[] = {60};
+const uint16_t mixIMIX[] = {60, 60, 60, 60, 60, 60, 60, 590, 590, 590, 590, 1514};
+const uint16_t mixBulk[] = {1514};
+
+struct mix_t {
+    const char *name;
+    const uint16_t *lengths;
+    uint8_t count;
+};
+const mix_t mixes[] = {
+    {"64 byte", mixSmall, sizeof(mixSmall) / sizeof(mixSmall[0])},
+    {"IMIX", mixIMIX, sizeof(mixIMIX) / sizeof(mixIMIX[0])},
+    {"1514 byte", mixBulk, sizeof(mixBulk) / sizeof(mixBulk[0])},
+};
+
+uint8_t rxBuffer[rxTransferSize] __attribute__ ((aligned(32)));
+uint8_t txBuffer[txTransferSize + ASIXFraming::txPadHeaderSize] __attribute__ ((aligned(32)));
+uint8_t payload[ASIXFraming::txMaxFrameSize];
+volatile uint32_t sink;
+
+void report(const char *mix, const char *path, uint32_t cycles, uint32_t frames, uint32_t bytes) {
+    Serial.printf("%-10s %-14s %8.1f ns/frame %6.3f bytes/cycle\n", mix, path,
+                  (double)cycles / frames * 1e9 / F_CPU, (double)bytes / cycles);
+}
+
+//Builds one aggregated bulk in transfer the way the adapter sends them,
+//returns its length and the frames and payload bytes in it
+uint32_t buildRx(const mix_t &mix, uint32_t &frames, uint32_t &bytes) {
+    uint32_t length = 0;
+    frames = bytes = 0;
+    for(uint8_t i = 0; ; i = (i + 1) % mix.count) {
+        uint16_t frameLength = mix.lengths[i];
+        if(length + ASIXFraming::rxHeaderSize + frameLength > rxTransferSize) break;
+        uint8_t *p = rxBuffer + length;
+        p[0] = frameLength & 0xFF;
+        p[1] = (frameLength >> 8) & 0x7;
+        p[2] = ~frameLength & 0xFF;
+        p[3] = (~frameLength >> 8) & 0x7;
+        p[4] = 0;
+        p[5] = 0;
+        memset(p + ASIXFraming::rxHeaderSize, 0x55, frameLength);
+        length = (length + ASIXFraming::rxHeaderSize + frameLength + 1) & ~1;
+        frames++;
+        bytes += frameLength;
+    }
+    return length;
+}
+
+void benchRx(const mix_t &mix) {
+    uint32_t frames, bytes;
+    uint32_t length = buildRx(mix, frames, bytes);
+    uint32_t seen = 0;
+    uint32_t start = ARM_DWT_CYCCNT;
+    for(uint32_t n = 0; n < iterations; n++) {
+        uint32_t offset = 0;
+        ASIXFraming::rxFrame_t frame;
+        while(ASIXFraming::nextFrame(rxBuffer, length, offset, frame) == ASIXFraming::RX_FRAME) {
+            seen += frame.length;
+        }
+    }
+    uint32_t cycles = ARM_DWT_CYCCNT - start;
+    sink = seen;
+    report(mix.name, "rx deframe", cycles, frames * iterations, bytes * iterations);
+}
+
+//One frame per transfer, what sendPacket does with coalescing off
+void benchTxSingle(const mix_t &mix) {
+    uint32_t frames = 0, bytes = 0;
+    uint32_t start = ARM_DWT_CYCCNT;
+    for(uint32_t n = 0; n < iterations * 16; n++) {
+        uint16_t frameLength = mix.lengths[n % mix.count];
+        ASIXFraming::fragment_t fragment = {payload, frameLength};
+        ASIXFraming::txHeader(txBuffer, frameLength);
+        ASIXFraming::gather(txBuffer + ASIXFraming::txHeaderSize, &fragment, 1);
+        sink = ASIXFraming::padTransfer(txBuffer, frameLength + ASIXFraming::txHeaderSize, packetSize);
+        frames++;
+        bytes += frameLength;
+    }
+    uint32_t cycles = ARM_DWT_CYCCNT - start;
+    report(mix.name, "tx single", cycles, frames, bytes);
+}
+
+//Frames packed 2 byte aligned into one transfer, what sendPackets and
+//setTxCoalescing do
+void benchTxPacked(const mix_t &mix) {
+    uint32_t frames = 0, bytes = 0;
+    uint32_t length = 0;
+    uint32_t start = ARM_DWT_CYCCNT;
+    for(uint32_t n = 0; n < iterations * 16; n++) {
+        uint16_t frameLength = mix.lengths[n % mix.count];
+        uint32_t offset = (length + 1) & ~1;
+        if(offset + ASIXFraming::txHeaderSize + frameLength > txTransferSize) {
+            sink = ASIXFraming::padTransfer(txBuffer, length, packetSize);
+            offset = 0;
+        }
+        ASIXFraming::fragment_t fragment = {payload, frameLength};
+        ASIXFraming::txHeader(txBuffer + offset, frameLength);
+        ASIXFraming::gather(txBuffer + offset + ASIXFraming::txHeaderSize, &fragment, 1);
+        length = offset + ASIXFraming::txHeaderSize + frameLength;
+        frames++;
+        bytes += frameLength;
+    }
+    uint32_t cycles = ARM_DWT_CYCCNT - start;
+    report(mix.name, "tx packed", cycles, frames, bytes);
+}
+
+void setup() {
+    while(!Serial && millis() < 5000) {}
+    ARM_DEMCR |= ARM_DEMCR_TRCENA;
+    ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+    memset(payload, 0xAA, sizeof(payload));
+    
+    Serial.print("Framing benchmark, F_CPU ");
+    Serial.println(F_CPU);
+    for(uint8_t i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++) {
+        benchRx(mixes[i]);
+        benchTxSingle(mixes[i]);
+        benchTxPacked(mixes[i]);
+    }
+}
+
+void loop() {
+}
@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include "FakeASIX.h"
+
+static const uint8_t interruptEndpoint = 0x81;
+static const uint8_t bulkInEndpoint = 0x82;
+static const uint8_t bulkOutEndpoint = 0x03;
+
+//Interface 0 of an AX88772B, vendor class with interrupt, bulk in and bulk out
+static const uint8_t descriptors[] = {
+    9, 4, 0, 0, 3, 0xFF, 0xFF, 0x00, 0x07,
+    7, 5, interruptEndpoint, 3, 8, 0, 11,
+    7, 5, bulkInEndpoint, 2, 0x00, 0x02, 0,
+    7, 5, bulkOutEndpoint, 2, 0x00, 0x02, 0,
+};
+
+FakeASIX::FakeASIX() {
+    static uint32_t serials = 0;
+    memset(&device, 0, sizeof(device));
+    device.idVendor = 0x0B95;
+    device.idProduct = 0x772B;
+    device.bDeviceClass = 0xFF;
+    device.strbuf = &strings;
+    memset(&strings, 0, sizeof(strings));
+    char serial[16];
+    snprintf(serial, sizeof(serial), "%06u", (unsigned)++serials);
+    setSerial(serial);
+    const uint8_t mac[6] = {0x00, 0x50, 0xB6, 0xBE, 0x8B, (uint8_t)serials};
+    memcpy(nodeID, mac, 6);
+    memset(phy, 0, sizeof(phy));
+    phy[0] = 0x3100;    //Autonegotiation, full duplex
+    phy[1] = 0x7849;    //Capabilities, link down
+    phy[2] = 0x003B;
+    phy[3] = 0x1881;
+    phy[4] = 0x01E1;
+    memset(multicast, 0, sizeof(multicast));
+}
+
+void FakeASIX::setSerial(const char *serial) {
+    //String 0 is the empty string, used when there isn't a serial number
+    strings.iStrings[strbuf_t::STR_ID_SERIAL] = serial[0] ? 1 : 0;
+    strncpy((char*)strings.buffer + 1, serial, sizeof(strings.buffer) - 2);
+}
+
+bool FakeASIX::plug() {
+    log.clear();
+    stationOwned = false;
+    if(!USBHost::mock_enumerate(&device, descriptors, sizeof(descriptors))) return false;
+    run();
+    return true;
+}
+
+bool FakeASIX::bringUp() {
+    return plug() && setLink(true);
+}
+
+void FakeASIX::unplug() {
+    rx_bursts.clear();
+    rx_burst_offset = 0;
+    USBHost::mock_disconnect(&device);
+}
+
+uint32_t FakeASIX::run() {
+    uint32_t n = 0;
+    Transfer_t *t;
+    while(!paused && (t = USBHost::mock_pending_control(&device))) {
+        answer(t);
+        USBHost::mock_complete(t, t->length);
+        n++;
+    }
+    return n;
+}
+
+void FakeASIX::answer(Transfer_t *transfer) {
+    const setup_t &s = transfer->setup;
+    uint8_t *data = (uint8_t*)transfer->buffer;
+    bool in = s.bmRequestType & 0x80;
+    request_t request = {s.bmRequestType, s.bRequest, s.wValue, s.wIndex, Bytes()};
+    if(in && data) memset(data, 0xFF, s.wLength);
+    uint16_t word = (!in && data && s.wLength >= 2) ? (data[0] | (data[1] << 8)) : 0;
+    switch(s.bRequest) {
+        case 6: stationOwned = true; break;
+        case 7:     //Read PHY, nothing answers at another address
+            if(s.wValue == phyAddress && data) {
+                data[0] = phy[s.wIndex & 31] & 0xFF;
+                data[1] = phy[s.wIndex & 31] >> 8;
+            }
+            break;
+        case 8:
+            if(s.wValue == phyAddress) phy[s.wIndex & 31] = word;
+            break;
+        case 9: if(data) data[0] = 0x20 | stationOwned; break;
+        case 10: stationOwned = false; break;
+        case 11:    //SROM words 4-6 hold the MAC
+            if(data && s.wValue >= 4 && s.wValue <= 6) memcpy(data, nodeID + (s.wValue - 4) * 2, 2);
+            break;
+        case 16: rxControl = s.wValue; break;
+        case 17: if(data) memcpy(data, ipg, 3); break;
+        case 18:
+            ipg[0] = s.wValue & 0xFF;
+            ipg[1] = s.wValue >> 8;
+            ipg[2] = s.wIndex;
+            break;
+        case 19: if(data) memcpy(data, nodeID, 6); break;
+        case 22: if(data) memcpy(multicast, data, 8); break;
+        case 25:
+            if(data) {
+                data[0] = 0xE0;
+                data[1] = phyAddress;
+            }
+            break;
+        case 26:
+            if(data) {
+                data[0] = mediumMode & 0xFF;
+                data[1] = mediumMode >> 8;
+            }
+            break;
+        case 27: mediumMode = s.wValue; break;
+        case 28: if(data) data[0] = 0x72; break;
+        case 33: if(data) data[0] = sw_interface; break;
+        case 34: sw_interface = s.wValue; break;
+        case 42:
+            aggregation[0] = s.wValue;
+            aggregation[1] = s.wIndex;
+            break;
+        default: break;
+    }
+    if(data) request.data.assign(data, data + s.wLength);
+    log.push_back(request);
+}
+
+uint32_t FakeASIX::count(uint8_t bRequest) {
+    uint32_t n = 0;
+    for(const request_t &r : log) n += r.bRequest == bRequest;
+    return n;
+}
+
+const FakeASIX::request_t* FakeASIX::last(uint8_t bRequest) {
+    for(auto r = log.rbegin(); r != log.rend(); ++r) {
+        if(r->bRequest == bRequest) return &*r;
+    }
+    return NULL;
+}
+
+bool FakeASIX::setLink(bool up, bool speed100, bool fullDuplex, bool pause) {
+    Transfer_t *t = USBHost::mock_pending(pipe(interruptEndpoint));
+    if(!t) return false;
+    phy[1] = up ? (phy[1] | 0x0024) : (phy[1] & ~0x0024);
+    uint16_t partner = 0;
+    if(up) {
+        partner = 0x4001;   //Acknowledge, 802.3
+        if(speed100) partner |= fullDuplex ? 0x0100 : 0x0080;
+        else partner |= fullDuplex ? 0x0040 : 0x0020;
+        if(pause) partner |= 0x0400;
+    }
+    phy[5] = partner;
+    uint8_t *p = (uint8_t*)t->buffer;
+    memset(p, 0, t->length);
+    p[0] = 0xA1;
+    p[2] = (up ? 0x01 : 0) | (speed100 ? 0x10 : 0);
+    USBHost::mock_complete(t, t->length);
+    run();
+    return true;
+}
+
+uint32_t FakeASIX::aggregationBytes() {
+    switch(aggregation[0]) {
+        case 0x8100: return 1024 * 4;
+        case 0x8300: return 1024 * 8;
+        case 0x8400: return 1024 * 16;
+        case 0x8600: return 1024 * 24;
+        case 0x8700: return 1024 * 32;
+        default: return 1024 * 2;
+    }
+}
+
+void FakeASIX::appendFrame(Bytes &burst, const uint8_t *frame, uint16_t length, uint16_t flags) {
+    burst.push_back(length & 0xFF);
+    burst.push_back((length >> 8) & 0x07);
+    burst.push_back(~length & 0xFF);
+    burst.push_back((~length >> 8) & 0x07);
+    burst.push_back(flags & 0xFF);
+    burst.push_back(flags >> 8);
+    burst.insert(burst.end(), frame, frame + length);
+    if(burst.size() & 1) burst.push_back(0);
+}
+
+void FakeASIX::queueBurst(const Bytes &burst) {
+    rx_bursts.push_back(burst);
+}
+
+void FakeASIX::queueFrames(const std::vector<Bytes> &frames, uint32_t burstBytes, uint16_t flags) {
+    if(!burstBytes) burstBytes = aggregationBytes();
+    Bytes burst;
+    for(const Bytes &frame : frames) {
+        appendFrame(burst, frame.data(), frame.size(), flags);
+        if(burst.size() >= burstBytes) {
+            queueBurst(burst);
+            burst.clear();
+        }
+    }
+    if(!burst.empty()) queueBurst(burst);
+}
+
+bool FakeASIX::loadPcap(const char *path, std::vector<Bytes> &frames) {
+    FILE *f = fopen(path, "rb");
+    if(!f) return false;
+    uint8_t header[24];
+    bool ok = fread(header, 1, sizeof(header), f) == sizeof(header);
+    uint32_t magic = header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t)header[3] << 24);
+    bool swapped = magic == 0xD4C3B2A1 || magic == 0x4D3CB2A1;
+    ok = ok && (swapped || magic == 0xA1B2C3D4 || magic == 0xA1B23C4D);
+    auto word = [swapped](const uint8_t *p) -> uint32_t {
+        return swapped ? ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]
+                       : p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    };
+    ok = ok && word(header + 20) == 1;     //LINKTYPE_ETHERNET
+    while(ok) {
+        uint8_t record[16];
+        if(fread(record, 1, sizeof(record), f) != sizeof(record)) break;
+        uint32_t length = word(record + 8);
+        Bytes frame(length);
+        if(length > 65535 || fread(frame.data(), 1, length, f) != length) {
+            ok = false;
+            break;
+        }
+        frames.push_back(frame);
+    }
+    fclose(f);
+    return ok;
+}
+
+uint32_t FakeASIX::rxQueued() {
+    uint32_t n = 0;
+    for(Transfer_t *t = USBHost::mock_pending(pipe(bulkInEndpoint)); t; t = t->next_followup) n++;
+    return n;
+}
+
+uint32_t FakeASIX::pump(uint32_t maxTransfers) {
+    uint32_t n = 0;
+    while(n < maxTransfers && !rx_bursts.empty()) {
+        Transfer_t *t = USBHost::mock_pending(pipe(bulkInEndpoint));
+        if(!t) break;
+        const Bytes &burst = rx_bursts.front();
+        uint32_t length = burst.size() - rx_burst_offset;
+        if(length > t->length) length = t->length;
+        memcpy(t->buffer, burst.data() + rx_burst_offset, length);
+        rx_burst_offset += length;
+        if(rx_burst_offset == burst.size()) {
+            rx_bursts.pop_front();
+            rx_burst_offset = 0;
+        }
+        USBHost::mock_complete(t, length);
+        n++;
+    }
+    return n;
+}
+
+uint32_t FakeASIX::txQueued() {
+    uint32_t n = 0;
+    for(Transfer_t *t = USBHost::mock_pending(pipe(bulkOutEndpoint)); t; t = t->next_followup) n++;
+    return n;
+}
+
+uint32_t FakeASIX::completeTx(uint32_t maxTransfers) {
+    uint32_t n = 0;
+    Transfer_t *t;
+    while(n < maxTransfers && (t = USBHost::mock_pending(pipe(bulkOutEndpoint)))) {
+        const uint8_t *p = (const uint8_t*)t->buffer;
+        uint32_t offset = unpackTx ? 0 : t->length;
+        while(offset + 4 <= t->length) {
+            uint16_t length = p[offset] | (p[offset + 1] << 8);
+            uint16_t check = p[offset + 2] | (p[offset + 3] << 8);
+            offset += 4;
+            if(length == 0x0000 && check == 0xFFFF) continue;   //Padding header
+            if((length & 0x07FF) != (~check & 0x07FF) || (length & 0xF800) || (check & 0xF800) != 0xF000) {
+                txErrors++;
+                break;
+            }
+            if(offset + length > t->length) {
+                txErrors++;
+                break;
+            }
+            sent.push_back(Bytes(p + offset, p + offset + length));
+            offset = (offset + length + 1) & ~1;
+        }
+        if(unpackTx) sentTransfers.push_back(t->length);
+        USBHost::mock_complete(t, t->length);
+        n++;
+    }
+    return n;
+}
@@ -0,0 +1,93 @@
+//Scripted AX88772B for the host tests. It answers the driver's register
+//requests from a small register file, raises link changes on the
+//interrupt endpoint, feeds recieve traffic to the queued bulk in transfers
+//and unpacks what is sent on bulk out back into frames
+
+#ifndef FakeASIX_h
+#define FakeASIX_h
+
+#include <USBHost_t36.h>
+#include <vector>
+#include <deque>
+
+typedef std::vector<uint8_t> Bytes;
+
+class FakeASIX {
+public:
+    struct request_t {
+        uint8_t bmRequestType;
+        uint8_t bRequest;
+        uint16_t wValue;
+        uint16_t wIndex;
+        Bytes data;         //Written by the driver or read back by it
+    };
+
+    //Every fake gets its own serial number so the driver's setup cache
+    //only matches when a test plugs the same one back in
+    FakeASIX();
+    void setSerial(const char *serial);
+
+    //Enumerates and runs the bring-up script, bringUp also raises the link
+    bool plug();
+    bool bringUp();
+    void unplug();
+    bool plugged() {return device.drivers != NULL;}
+    //Answers control transfers until none are queued, returns how many
+    uint32_t run();
+    //Queued control transfers are left waiting when paused
+    bool paused = false;
+
+    //Link change on the interrupt endpoint, the PHY's link partner
+    //register follows it. Returns false if no interrupt transfer is queued
+    bool setLink(bool up, bool speed100 = true, bool fullDuplex = true, bool pause = true);
+
+    //The adapter ends a bulk in burst once it holds burstBytes (0 is the
+    //aggregation size the driver set), so a burst runs up to one frame
+    //past it and a host buffer that size splits the last frame
+    static void appendFrame(Bytes &burst, const uint8_t *frame, uint16_t length, uint16_t flags = 0);
+    void queueBurst(const Bytes &burst);
+    void queueFrames(const std::vector<Bytes> &frames, uint32_t burstBytes = 0, uint16_t flags = 0);
+    //Classic libpcap with ethernet link type, frames as captured
+    static bool loadPcap(const char *path, std::vector<Bytes> &frames);
+    //Moves queued bursts into the driver's bulk in transfers, a burst ends
+    //a transfer early and one longer than the transfer continues in the
+    //next. Returns the transfers completed
+    uint32_t pump(uint32_t maxTransfers = 0xFFFFFFFF);
+    uint32_t rxWaiting() {return rx_bursts.size();}
+    uint32_t rxQueued();            //Bulk in transfers the driver has queued
+    uint32_t aggregationBytes();
+
+    //Completes bulk out transfers and unpacks their frames into sent
+    uint32_t completeTx(uint32_t maxTransfers = 0xFFFFFFFF);
+    uint32_t txQueued();
+    std::vector<Bytes> sent;
+    std::vector<uint32_t> sentTransfers;    //Length of each bulk out transfer
+    uint32_t txErrors = 0;                  //Malformed transmit headers
+    bool unpackTx = true;                   //Off to only complete them
+
+    //Register file
+    std::vector<request_t> log;
+    uint32_t count(uint8_t bRequest);
+    const request_t* last(uint8_t bRequest);
+    uint8_t nodeID[6];
+    uint8_t phyAddress = 0x10;
+    uint16_t phy[32];
+    uint16_t rxControl = 0;
+    uint16_t mediumMode = 0;
+    uint16_t aggregation[2] = {0, 0};
+    uint8_t multicast[8];
+    bool stationOwned = false;
+
+    Device_t device;
+    strbuf_t strings;
+
+private:
+    void answer(Transfer_t *transfer);
+    Pipe_t* pipe(uint8_t endpoint) {return USBHost::mock_pipe(&device, endpoint);}
+    std::deque<Bytes> rx_bursts;
+    uint32_t rx_burst_offset = 0;
+    uint8_t ipg[3] = {0, 0, 0};
+    uint8_t sw_interface = 0;
+};
+
+#endif
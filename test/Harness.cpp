@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <string>
+#include "Harness.h"
+
+static TestCase *first_case;
+static TestCase **last_case = &first_case;
+static bool case_failed;
+
+TestCase::TestCase(const char *name, void (*run)()) : name(name), run(run), next(NULL) {
+    *last_case = this;
+    last_case = &next;
+}
+
+void test_fail(const char *file, int line, const char *expression) {
+    printf("  %s:%d: CHECK(%s) failed\n", file, line, expression);
+    case_failed = true;
+}
+
+void test_fail_equal(const char *file, int line, const char *a, const char *b, long long va, long long vb) {
+    printf("  %s:%d: CHECK_EQ(%s, %s) failed, %lld != %lld\n", file, line, a, b, va, vb);
+    case_failed = true;
+}
+
+namespace capture {
+    std::vector<Bytes> frames;
+    std::vector<Bytes> transfers;
+    std::vector<ASIXEthernetBase::frameInfo_t> info;
+    ASIXEthernetBase *driver;
+
+    void frame(const uint8_t *data, uint32_t length) {
+        frames.push_back(Bytes(data, data + length));
+        if(driver) info.push_back(driver->frameInfo());
+    }
+
+    void transfer(const uint8_t *data, uint32_t length) {
+        transfers.push_back(Bytes(data, data + length));
+    }
+
+    void reset() {
+        frames.clear();
+        transfers.clear();
+        info.clear();
+        driver = NULL;
+    }
+}
+
+Bytes testFrame(uint16_t length, uint16_t etherType, uint8_t seed, const uint8_t *destination) {
+    static const uint8_t broadcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    static const uint8_t source[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+    Bytes frame(length);
+    for(uint16_t i = 0; i < length; i++) frame[i] = seed + i;
+    memcpy(frame.data(), destination ? destination : broadcast, 6);
+    memcpy(frame.data() + 6, source, 6);
+    frame[12] = etherType >> 8;
+    frame[13] = etherType & 0xFF;
+    return frame;
+}
+
+std::vector<Bytes> testFrames(uint32_t count, uint16_t length, uint16_t etherType) {
+    std::vector<Bytes> frames;
+    for(uint32_t i = 0; i < count; i++) frames.push_back(testFrame(length, etherType, i));
+    return frames;
+}
+
+const char* testData(const char *name) {
+    static std::string path;
+    path = std::string(ASIX_TEST_DATA) + "/" + name;
+    return path.c_str();
+}
+
+int main(int argc, char **argv) {
+    int failed = 0, run = 0;
+    for(TestCase *c = first_case; c; c = c->next) {
+        if(argc > 1 && std::string(argv[1]) != c->name) continue;
+        USBHost::mock_reset();
+        capture::reset();
+        case_failed = false;
+        c->run();
+        run++;
+        printf("%s %s\n", case_failed ? "FAIL" : "ok  ", c->name);
+        if(case_failed) failed++;
+    }
+    printf("%d of %d passed\n", run - failed, run);
+    return failed ? 1 : 0;
+}
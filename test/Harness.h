@@ -0,0 +1,58 @@
+//Small test runner shared by the host tests. Each test_*.cpp covers one
+//feature with TEST() cases, links Harness.cpp for main() and gets a fresh
+//mock USB host and cleared capture buffers before every case
+
+#ifndef Harness_h
+#define Harness_h
+
+#include <ASIXEthernet.h>
+#include <vector>
+#include "FakeASIX.h"
+
+//Geometry most tests use, 4k bulk in transfers keep the bursts short
+typedef ASIXEthernetT<1024 * 4, 4, 8> TestDriver;
+
+struct TestCase {
+    TestCase(const char *name, void (*run)());
+    const char *name;
+    void (*run)();
+    TestCase *next;
+};
+
+void test_fail(const char *file, int line, const char *expression);
+void test_fail_equal(const char *file, int line, const char *a, const char *b, long long va, long long vb);
+
+#define TEST(name) \
+    static void name(); \
+    static TestCase name##_case(#name, name); \
+    static void name()
+
+#define CHECK(condition) do { \
+        if(!(condition)) { test_fail(__FILE__, __LINE__, #condition); return; } \
+    } while(0)
+
+#define CHECK_EQ(a, b) do { \
+        long long a_ = (long long)(a), b_ = (long long)(b); \
+        if(a_ != b_) { test_fail_equal(__FILE__, __LINE__, #a, #b, a_, b_); return; } \
+    } while(0)
+
+//Driver callbacks are plain function pointers, these collect what they see
+namespace capture {
+    extern std::vector<Bytes> frames;           //setHandleRecieveFrame and EtherType handlers
+    extern std::vector<Bytes> transfers;        //setHandleRecieve
+    extern std::vector<ASIXEthernetBase::frameInfo_t> info;
+    extern ASIXEthernetBase *driver;            //Set by tests that need frameInfo() in the callback
+    void frame(const uint8_t *data, uint32_t length);
+    void transfer(const uint8_t *data, uint32_t length);
+    void reset();
+}
+
+//Test frame with a given destination, EtherType and length, the payload
+//counts up from seed so frames can be told apart
+Bytes testFrame(uint16_t length, uint16_t etherType = 0x0800, uint8_t seed = 0, const uint8_t *destination = NULL);
+std::vector<Bytes> testFrames(uint32_t count, uint16_t length, uint16_t etherType = 0x0800);
+
+//Path of a file in test/data
+const char* testData(const char *name);
+
+#endif
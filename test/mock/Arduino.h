@@ -0,0 +1,37 @@
+//Host stand-in for the parts of the Teensy core the driver uses, only for
+//building the tests and benchmark on a desktop
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HEX 16
+#define DEC 10
+#define F_CPU 600000000
+#define DMAMEM
+#define FASTRUN
+
+//Everything runs on one thread so masking the USB interrupt is a no-op,
+//except that unmasking runs an interrupt a test has raised
+#define IRQ_USBHS 112
+#define NVIC_DISABLE_IRQ(n) ((void)(n))
+#define NVIC_ENABLE_IRQ(n) mock_enable_irq()
+void mock_enable_irq();
+
+uint32_t micros();
+uint32_t millis();
+void delay(uint32_t ms);
+void yield();
+
+//Test hooks, not part of the Teensy core. Time only moves when a test
+//moves it
+void mock_set_micros(uint32_t now);
+void mock_advance_micros(uint32_t us);
+//Runs isr(context) once, the next time the driver unmasks the USB interrupt
+void mock_raise_irq(void (*isr)(void *context), void *context);
+
+#endif
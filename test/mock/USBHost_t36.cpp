@@ -0,0 +1,256 @@
+#include "USBHost_t36.h"
+
+static Pipe_t *free_pipes;
+static Transfer_t *free_transfers;
+static uint32_t free_transfer_count;
+static uint32_t failed_queues;
+static USBDriver *available_drivers;
+static Transfer_t *control_queued;
+static Pipe_t *active_pipes;
+
+static uint32_t now_micros;
+
+uint32_t micros() {return now_micros;}
+uint32_t millis() {return now_micros / 1000;}
+void delay(uint32_t ms) {now_micros += ms * 1000;}
+void yield() {}
+void mock_set_micros(uint32_t now) {now_micros = now;}
+void mock_advance_micros(uint32_t us) {now_micros += us;}
+
+static void (*pending_isr)(void *context);
+static void *pending_context;
+
+void mock_raise_irq(void (*isr)(void *context), void *context) {
+    pending_isr = isr;
+    pending_context = context;
+}
+
+void mock_enable_irq() {
+    void (*isr)(void *context) = pending_isr;
+    pending_isr = NULL;
+    if(isr) (*isr)(pending_context);
+}
+
+static Transfer_t* allocate_transfers(uint8_t parts) {
+    //All or nothing, like the EHCI code backing out a partial queue
+    if(free_transfer_count < parts) return NULL;
+    Transfer_t *first = NULL;
+    for(uint8_t i = 0; i < parts; i++) {
+        Transfer_t *t = free_transfers;
+        free_transfers = t->next_followup;
+        free_transfer_count--;
+        memset(t, 0, sizeof(Transfer_t));
+        t->prev_followup = first;
+        first = t;
+    }
+    first->mock_parts = parts;
+    return first;
+}
+
+static void free_transfer_chain(Transfer_t *t) {
+    while(t) {
+        Transfer_t *extra = t->prev_followup;
+        t->next_followup = free_transfers;
+        free_transfers = t;
+        free_transfer_count++;
+        t = extra;
+    }
+}
+
+static void append(Transfer_t *&list, Transfer_t *t) {
+    t->next_followup = NULL;
+    Transfer_t **p = &list;
+    while(*p) p = &(*p)->next_followup;
+    *p = t;
+}
+
+static bool unlink(Transfer_t *&list, Transfer_t *t) {
+    for(Transfer_t **p = &list; *p; p = &(*p)->next_followup) {
+        if(*p == t) {
+            *p = t->next_followup;
+            return true;
+        }
+    }
+    return false;
+}
+
+void USBHost::mock_reset() {
+    free_pipes = NULL;
+    free_transfers = NULL;
+    free_transfer_count = 0;
+    failed_queues = 0;
+    available_drivers = NULL;
+    control_queued = NULL;
+    active_pipes = NULL;
+    now_micros = 0;
+    pending_isr = NULL;
+}
+
+void USBHost::contribute_Pipes(Pipe_t *pipes, uint32_t num) {
+    for(uint32_t i = 0; i < num; i++) {
+        pipes[i].mock_next = free_pipes;
+        free_pipes = &pipes[i];
+    }
+}
+
+void USBHost::contribute_Transfers(Transfer_t *transfers, uint32_t num) {
+    for(uint32_t i = 0; i < num; i++) {
+        transfers[i].next_followup = free_transfers;
+        free_transfers = &transfers[i];
+        free_transfer_count++;
+    }
+}
+
+void USBHost::contribute_String_Buffers(strbuf_t *strbuf, uint32_t num) {}
+
+void USBHost::driver_ready_for_device(USBDriver *driver) {
+    driver->device = NULL;
+    driver->next = available_drivers;
+    available_drivers = driver;
+}
+
+Pipe_t* USBHost::new_Pipe(Device_t *dev, uint32_t type, uint32_t endpoint, uint32_t direction,
+                          uint32_t maxlen, uint32_t interval) {
+    if(!free_pipes) return NULL;
+    Transfer_t *halt = allocate_transfers(1);
+    if(!halt) return NULL;
+    Pipe_t *pipe = free_pipes;
+    free_pipes = pipe->mock_next;
+    pipe->device = dev;
+    pipe->type = type;
+    pipe->endpoint = (endpoint & 0x0F) | (direction ? 0x80 : 0);
+    pipe->maxlen = maxlen;
+    pipe->callback_function = NULL;
+    pipe->halt = halt;
+    pipe->queued = NULL;
+    pipe->mock_next = active_pipes;
+    active_pipes = pipe;
+    return pipe;
+}
+
+bool USBHost::queue_Control_Transfer(Device_t *dev, setup_t *setup, void *buf, USBDriver *driver) {
+    //Setup, status and a data stage when there is data
+    Transfer_t *t = allocate_transfers(setup->wLength ? 3 : 2);
+    if(!t) {
+        failed_queues++;
+        return false;
+    }
+    t->setup = *setup;
+    t->buffer = buf;
+    t->length = setup->wLength;
+    t->driver = driver;
+    t->mock_device = dev;
+    append(control_queued, t);
+    return true;
+}
+
+bool USBHost::queue_Data_Transfer(Pipe_t *pipe, void *buffer, uint32_t len, USBDriver *driver) {
+    //One qTD moves at most 16k
+    Transfer_t *t = allocate_transfers(len ? (len + 16383) / 16384 : 1);
+    if(!t) {
+        failed_queues++;
+        return false;
+    }
+    t->pipe = pipe;
+    t->buffer = buffer;
+    t->length = len;
+    t->driver = driver;
+    append(pipe->queued, t);
+    return true;
+}
+
+USBDriver* USBHost::mock_enumerate(Device_t *dev, const uint8_t *descriptors, uint32_t len) {
+    dev->drivers = NULL;
+    for(int type = 0; type <= 1; type++) {
+        for(USBDriver **p = &available_drivers; *p; p = &(*p)->next) {
+            USBDriver *driver = *p;
+            if(driver->claim(dev, type, descriptors, len)) {
+                *p = driver->next;
+                driver->device = dev;
+                driver->next = NULL;
+                dev->drivers = driver;
+                return driver;
+            }
+        }
+    }
+    return NULL;
+}
+
+void USBHost::mock_disconnect(Device_t *dev) {
+    USBDriver *driver = dev->drivers;
+    if(driver) {
+        driver->disconnect();
+        driver->device = NULL;
+        driver->next = available_drivers;
+        available_drivers = driver;
+        dev->drivers = NULL;
+    }
+    //Pipes go back to the pool with everything still queued on them
+    for(Pipe_t **p = &active_pipes; *p; ) {
+        Pipe_t *pipe = *p;
+        if(pipe->device != dev) {
+            p = &pipe->mock_next;
+            continue;
+        }
+        *p = pipe->mock_next;
+        while(pipe->queued) {
+            Transfer_t *t = pipe->queued;
+            pipe->queued = t->next_followup;
+            free_transfer_chain(t);
+        }
+        free_transfer_chain(pipe->halt);
+        pipe->device = NULL;
+        pipe->mock_next = free_pipes;
+        free_pipes = pipe;
+    }
+    for(Transfer_t **p = &control_queued; *p; ) {
+        Transfer_t *t = *p;
+        if(t->mock_device != dev) {
+            p = &t->next_followup;
+            continue;
+        }
+        *p = t->next_followup;
+        free_transfer_chain(t);
+    }
+}
+
+Pipe_t* USBHost::mock_pipe(Device_t *dev, uint8_t endpoint) {
+    for(Pipe_t *pipe = active_pipes; pipe; pipe = pipe->mock_next) {
+        if(pipe->device == dev && pipe->endpoint == endpoint) return pipe;
+    }
+    return NULL;
+}
+
+Transfer_t* USBHost::mock_pending(Pipe_t *pipe) {
+    return pipe ? pipe->queued : NULL;
+}
+
+Transfer_t* USBHost::mock_pending_control(Device_t *dev) {
+    for(Transfer_t *t = control_queued; t; t = t->next_followup) {
+        if(t->mock_device == dev) return t;
+    }
+    return NULL;
+}
+
+void USBHost::mock_complete(Transfer_t *transfer, uint32_t actual) {
+    if(actual > transfer->length) actual = transfer->length;
+    transfer->qtd.token = ((transfer->length - actual) & 0x7FFF) << 16;
+    if(transfer->mock_device) {
+        if(!unlink(control_queued, transfer)) return;
+        USBDriver *driver = transfer->driver;
+        if(driver) driver->control(transfer);
+    }
+    else {
+        if(!unlink(transfer->pipe->queued, transfer)) return;
+        if(transfer->pipe->callback_function) (*transfer->pipe->callback_function)(transfer);
+    }
+    free_transfer_chain(transfer);
+}
+
+uint32_t USBHost::mock_free_transfers() {
+    return free_transfer_count;
+}
+
+uint32_t USBHost::mock_failed_queues() {
+    return failed_queues;
+}
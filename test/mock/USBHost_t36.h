@@ -0,0 +1,136 @@
+//Host stand-in for USBHost_t36, only what the driver uses. Transfers come
+//out of the pools drivers contribute, the same way the EHCI code takes
+//them, and sit on their pipe until a test completes them with the hooks
+//at the end of USBHost. Completing one runs the driver's callback first
+//and frees the transfer after, like the real interrupt handler
+
+#ifndef USBHost_t36_h
+#define USBHost_t36_h
+
+#include <Arduino.h>
+
+class USBDriver;
+typedef struct Device_struct Device_t;
+typedef struct Pipe_struct Pipe_t;
+typedef struct Transfer_struct Transfer_t;
+typedef struct strbuf_struct strbuf_t;
+
+typedef union {
+    struct {
+        union {
+            struct {
+                uint8_t bmRequestType;
+                uint8_t bRequest;
+            };
+            uint16_t wRequestAndType;
+        };
+        uint16_t wValue;
+        uint16_t wIndex;
+        uint16_t wLength;
+    };
+    struct {
+        uint32_t word1;
+        uint32_t word2;
+    };
+} setup_t;
+
+typedef struct {
+    uint32_t next;
+    uint32_t alt_next;
+    uint32_t token;     //Bits 16-30 are the bytes not transferred
+    uint32_t buffer[5];
+} ehci_qtd_t;
+
+struct strbuf_struct {
+    strbuf_t *next;
+    Device_t *device;
+    uint8_t iStrings[3];    //Offsets into buffer of each NUL terminated string
+    uint8_t buffer[128];
+    enum {STR_ID_MAN = 0, STR_ID_PROD, STR_ID_SERIAL, STR_ID_CNT};
+};
+
+struct Device_struct {
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint8_t bDeviceClass;
+    uint8_t bDeviceSubClass;
+    uint8_t bDeviceProtocol;
+    strbuf_t *strbuf;
+    USBDriver *drivers;     //Driver that claimed it
+};
+
+struct Pipe_struct {
+    Device_t *device;
+    uint8_t type;           //0 control, 2 bulk, 3 interrupt
+    uint8_t endpoint;       //Address with the direction bit
+    uint16_t maxlen;
+    void (*callback_function)(const Transfer_t *);
+    Transfer_t *halt;       //Every pipe keeps one qTD parked at its end
+    Transfer_t *queued;     //Oldest queued transfer first
+    Pipe_t *mock_next;
+};
+
+struct Transfer_struct {
+    ehci_qtd_t qtd;
+    Transfer_t *next_followup;
+    Transfer_t *prev_followup;
+    Pipe_t *pipe;
+    void *buffer;
+    uint32_t length;
+    setup_t setup;
+    USBDriver *driver;
+    Device_t *mock_device;  //Only set on control transfers
+    uint8_t mock_parts;     //Transfer_t taken from the pool, chained on prev_followup
+};
+
+class USBHost {
+public:
+    static void begin() {}
+    static void Task() {}
+
+    //Test hooks, not part of USBHost_t36
+    static void mock_reset();
+    //Offers the interface to every driver waiting for a device, returns
+    //the one that claimed it
+    static USBDriver* mock_enumerate(Device_t *dev, const uint8_t *descriptors, uint32_t len);
+    static void mock_disconnect(Device_t *dev);
+    static Pipe_t* mock_pipe(Device_t *dev, uint8_t endpoint);
+    static Transfer_t* mock_pending(Pipe_t *pipe);
+    static Transfer_t* mock_pending_control(Device_t *dev);
+    //actual is how many bytes moved, a control transfer calls the driver's
+    //control() and a data transfer its pipe callback
+    static void mock_complete(Transfer_t *transfer, uint32_t actual);
+    static uint32_t mock_free_transfers();
+    static uint32_t mock_failed_queues();
+
+protected:
+    static Pipe_t* new_Pipe(Device_t *dev, uint32_t type, uint32_t endpoint, uint32_t direction,
+                            uint32_t maxlen, uint32_t interval = 0);
+    static bool queue_Control_Transfer(Device_t *dev, setup_t *setup, void *buf, USBDriver *driver);
+    static bool queue_Data_Transfer(Pipe_t *pipe, void *buffer, uint32_t len, USBDriver *driver);
+    static void contribute_Pipes(Pipe_t *pipes, uint32_t num);
+    static void contribute_Transfers(Transfer_t *transfers, uint32_t num);
+    static void contribute_String_Buffers(strbuf_t *strbuf, uint32_t num);
+    static void driver_ready_for_device(USBDriver *driver);
+    static void mk_setup(setup_t &s, uint32_t bmRequestType, uint32_t bRequest,
+                         uint32_t wValue, uint32_t wIndex, uint32_t wLength) {
+        s.word1 = bmRequestType | (bRequest << 8) | (wValue << 16);
+        s.word2 = wIndex | (wLength << 16);
+    }
+    template<typename... T> static void print_(T...) {}
+    template<typename... T> static void println_(T...) {}
+    static void print_hexbytes(const void *ptr, uint32_t len) {}
+};
+
+class USBDriver : public USBHost {
+protected:
+    USBDriver() : next(NULL), device(NULL) {}
+    virtual bool claim(Device_t *device, int type, const uint8_t *descriptors, uint32_t len) {return false;}
+    virtual void control(const Transfer_t *transfer) {}
+    virtual void disconnect() {}
+    USBDriver *next;
+    Device_t *device;
+    friend class USBHost;
+};
+
+#endif
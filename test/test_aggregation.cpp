@@ -0,0 +1,96 @@
+//Adaptive bulk in aggregation size, adjusted from read() every window
+
+#include "Harness.h"
+
+static USBHost host;
+
+//The register values come from the same table the adaptive steps use
+static_assert(ASIXEthernetBase::aggregationValue(1024 * 16) == 0x8400, "16k aggregation");
+static_assert(ASIXEthernetBase::aggregationIndex(1024 * 16) == 0x851E, "16k aggregation");
+static_assert(ASIXEthernetBase::aggregationValue(1024 * 6) == 0x8100, "Sizes round down to a setting");
+static_assert(ASIXEthernetBase::aggregationIndex(1024) == 0x8001, "Smaller than 2k uses 2k");
+
+static void queueTransfer(FakeASIX &adapter, const std::vector<Bytes> &frames) {
+    Bytes burst;
+    for(const Bytes &frame : frames) FakeASIX::appendFrame(burst, frame.data(), frame.size());
+    adapter.queueBurst(burst);
+}
+
+//Sends the transfers then ends the window
+static void window(FakeASIX &adapter, ASIXEthernetBase &asix, const std::vector<Bytes> &frames, int transfers) {
+    for(int i = 0; i < transfers; i++) {
+        queueTransfer(adapter, frames);
+        adapter.pump();
+    }
+    mock_advance_micros(100000);
+    asix.read(0);
+    adapter.run();
+}
+
+TEST(raw_transfers_shrink_when_mostly_empty) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieve(capture::transfer);
+    CHECK(adapter.bringUp());
+    asix.setAdaptiveAggregation(true);
+    CHECK_EQ(asix.aggregationSize(), 1024 * 4);
+    for(int i = 0; i < 3; i++) window(adapter, asix, testFrames(1, 60), 10);
+    CHECK_EQ(asix.aggregationSize(), 1024 * 4);
+    window(adapter, asix, testFrames(1, 60), 10);
+    CHECK_EQ(asix.aggregationSize(), 1024 * 2);
+    CHECK_EQ(adapter.aggregation[0], 0x8000);
+    CHECK_EQ(capture::transfers.size(), 40);
+}
+
+TEST(full_size_frames_grow_past_2k) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    CHECK(adapter.bringUp());
+    asix.setAdaptiveAggregation(true);
+    for(int i = 0; i < 4; i++) window(adapter, asix, testFrames(1, 60), 10);
+    CHECK_EQ(asix.aggregationSize(), 1024 * 2);
+    //Under load one 1514 byte frame fills a 2k transfer, a second wouldn't fit
+    window(adapter, asix, testFrames(1, 1514), 200);
+    CHECK_EQ(asix.aggregationSize(), 1024 * 4);
+    CHECK_EQ(adapter.aggregation[0], 0x8100);
+    CHECK_EQ(asix.aggregationChanges(), 2);
+}
+
+TEST(part_full_transfers_keep_the_size) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    CHECK(adapter.bringUp());
+    asix.setAdaptiveAggregation(true);
+    //About 1.5k in a 4k transfer, neither filling nor completing nearly empty
+    for(int i = 0; i < 8; i++) window(adapter, asix, testFrames(3, 500), 10);
+    CHECK_EQ(asix.aggregationSize(), 1024 * 4);
+    CHECK_EQ(asix.aggregationChanges(), 0);
+}
+
+TEST(sparse_medium_frames_settle_small) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    CHECK(adapter.bringUp());
+    asix.setAdaptiveAggregation(true);
+    //Request/response traffic, each frame alone in its transfer
+    for(int i = 0; i < 40; i++) window(adapter, asix, testFrames(1, 600), 5);
+    CHECK_EQ(asix.aggregationSize(), 1024 * 2);
+    CHECK(asix.aggregationChanges() <= 1);
+}
+
+TEST(sparse_full_size_frames_dont_grow) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieve(capture::transfer);
+    CHECK(adapter.bringUp());
+    asix.setAdaptiveAggregation(true);
+    for(int i = 0; i < 4; i++) window(adapter, asix, testFrames(1, 60), 10);
+    CHECK_EQ(asix.aggregationSize(), 1024 * 2);
+    //A 1514 byte frame fills a 2k transfer, but a few a window aren't load
+    for(int i = 0; i < 20; i++) window(adapter, asix, testFrames(1, 1514), 5);
+    CHECK_EQ(asix.aggregationSize(), 1024 * 2);
+    CHECK_EQ(asix.aggregationChanges(), 1);
+}
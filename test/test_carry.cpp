@@ -0,0 +1,144 @@
+//Frames split across two bulk in transfers when a burst overruns the
+//host's transfer size
+
+#include "Harness.h"
+
+static USBHost host;
+typedef ASIXEthernetT<1024 * 2, 4, 8> SmallDriver;
+
+//Burst of frames whose total before the last one is lead bytes, so the
+//last header starts lead bytes into the 2k transfer
+static Bytes burstWithSplit(uint32_t lead, uint16_t lastLength, std::vector<Bytes> &frames) {
+    Bytes burst;
+    for(uint32_t left = lead; left; ) {
+        uint16_t length = left >= 1000 + 2 * ASIXFraming::rxHeaderSize + 14 ? 1000 : left - ASIXFraming::rxHeaderSize;
+        frames.push_back(testFrame(length, 0x0800, frames.size()));
+        FakeASIX::appendFrame(burst, frames.back().data(), length);
+        left -= ASIXFraming::rxHeaderSize + length;
+    }
+    frames.push_back(testFrame(lastLength, 0x0800, frames.size()));
+    FakeASIX::appendFrame(burst, frames.back().data(), lastLength);
+    return burst;
+}
+
+TEST(frame_split_after_its_header_is_joined) {
+    FakeASIX adapter;
+    SmallDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    CHECK(adapter.bringUp());
+    std::vector<Bytes> frames;
+    adapter.queueBurst(burstWithSplit(2000, 600, frames));
+    CHECK_EQ(adapter.pump(), 2);
+    CHECK(capture::frames == frames);
+    ASIXEthernetBase::statistics_t stats;
+    asix.getStatistics(stats);
+    CHECK_EQ(stats.rxSplitFrames, 1);
+    CHECK_EQ(stats.rxTruncatedFrames, 0);
+}
+
+TEST(frame_split_inside_its_header_is_joined) {
+    for(uint32_t lead = 2048 - 4; lead <= 2048; lead += 2) {
+        FakeASIX adapter;
+        SmallDriver asix(host);
+        capture::reset();
+        asix.setHandleRecieveFrame(capture::frame);
+        CHECK(adapter.bringUp());
+        std::vector<Bytes> frames;
+        Bytes burst = burstWithSplit(lead, 400, frames);
+        adapter.queueBurst(burst);
+        std::vector<Bytes> next = testFrames(2, 64);
+        adapter.queueFrames(next, 1);
+        frames.insert(frames.end(), next.begin(), next.end());
+        while(adapter.rxWaiting()) CHECK(adapter.pump());
+        CHECK(capture::frames == frames);
+        adapter.unplug();
+        USBHost::mock_reset();
+    }
+}
+
+TEST(back_to_back_splits_stay_in_order) {
+    FakeASIX adapter;
+    SmallDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    CHECK(adapter.bringUp());
+    //Every burst overruns the 2k aggregation size by most of a frame
+    std::vector<Bytes> frames = testFrames(60, 1400);
+    adapter.queueFrames(frames);
+    while(adapter.rxWaiting()) CHECK(adapter.pump());
+    CHECK(capture::frames == frames);
+    ASIXEthernetBase::statistics_t stats;
+    asix.getStatistics(stats);
+    CHECK(stats.rxSplitFrames > 0);
+    CHECK_EQ(stats.rxTruncatedFrames, 0);
+}
+
+static bool retained;
+static void retain_frame(const uint8_t *data, uint32_t length) {
+    ASIXEthernetBase::frameHandle_t handle;
+    retained = capture::driver->retainFrame(handle);
+    if(retained) capture::driver->releaseFrame(handle);
+    capture::frame(data, length);
+}
+
+TEST(joined_frame_cannot_be_retained) {
+    FakeASIX adapter;
+    SmallDriver asix(host);
+    capture::driver = &asix;
+    asix.setHandleRecieveFrame(retain_frame);
+    CHECK(adapter.bringUp());
+    std::vector<Bytes> frames;
+    adapter.queueBurst(burstWithSplit(2000, 600, frames));
+    CHECK(adapter.pump(1));
+    CHECK_EQ(capture::frames.size(), frames.size() - 1);
+    CHECK(retained);
+    CHECK(adapter.pump(1));
+    CHECK_EQ(capture::frames.size(), frames.size());
+    CHECK(!retained);
+}
+
+TEST(short_transfer_ending_mid_frame_is_truncated) {
+    FakeASIX adapter;
+    SmallDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    CHECK(adapter.bringUp());
+    Bytes frame = testFrame(500);
+    Bytes burst;
+    FakeASIX::appendFrame(burst, frame.data(), frame.size());
+    FakeASIX::appendFrame(burst, frame.data(), frame.size());
+    burst.resize(burst.size() - 100);
+    adapter.queueBurst(burst);
+    adapter.queueFrames(testFrames(1, 64), 1);
+    CHECK_EQ(adapter.pump(), 2);
+    CHECK_EQ(capture::frames.size(), 2);
+    CHECK(capture::frames[0] == frame);
+    ASIXEthernetBase::statistics_t stats;
+    asix.getStatistics(stats);
+    CHECK_EQ(stats.rxTruncatedFrames, 1);
+    CHECK_EQ(stats.rxSplitFrames, 0);
+}
+
+TEST(short_transfer_of_whole_packets_is_not_carried) {
+    FakeASIX adapter;
+    SmallDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    CHECK(adapter.bringUp());
+    Bytes first = testFrame(500, 0x0800, 1);
+    Bytes second = testFrame(600, 0x0800, 2);
+    Bytes burst;
+    FakeASIX::appendFrame(burst, first.data(), first.size());
+    FakeASIX::appendFrame(burst, second.data(), second.size());
+    burst.resize(1024);     //Two whole packets but short of the 2k transfer
+    adapter.queueBurst(burst);
+    //Long enough that joining it to the cut off frame would swallow part
+    std::vector<Bytes> next = testFrames(2, 200);
+    adapter.queueFrames(next, 4096);
+    CHECK_EQ(adapter.pump(), 2);
+    CHECK_EQ(capture::frames.size(), 3);
+    CHECK(capture::frames[0] == first);
+    CHECK(capture::frames[1] == next[0]);
+    CHECK(capture::frames[2] == next[1]);
+    ASIXEthernetBase::statistics_t stats;
+    asix.getStatistics(stats);
+    CHECK_EQ(stats.rxTruncatedFrames, 1);
+    CHECK_EQ(stats.rxSplitFrames, 0);
+}
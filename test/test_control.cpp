@@ -0,0 +1,280 @@
+//Runtime register access through the control request ring
+
+#include "Harness.h"
+
+static USBHost host;
+
+static std::vector<uint32_t> completed;
+static void on_complete(void *context, const uint8_t *data, uint16_t length) {
+    completed.push_back((uint32_t)(uintptr_t)context);
+}
+
+TEST(requests_complete_in_order_with_results) {
+    completed.clear();
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    adapter.paused = true;
+    uint8_t node[6] = {0, 0, 0, 0, 0, 0};
+    uint8_t ipg[3] = {0, 0, 0};
+    CHECK(asix.controlRequest(0x40, 18, 0x1015, 0x1A, 0, NULL, NULL, on_complete, (void*)1));
+    CHECK(asix.controlRequest(0xC0, 17, 0, 0, 3, NULL, ipg, on_complete, (void*)2));
+    CHECK(asix.controlRequest(0xC0, 19, 0, 0, 6, NULL, node, on_complete, (void*)3));
+    CHECK(!asix.controlIdle());
+    CHECK_EQ(adapter.run(), 0);
+    adapter.paused = false;
+    CHECK_EQ(adapter.run(), 3);
+    CHECK(asix.controlIdle());
+    CHECK_EQ(completed.size(), 3);
+    CHECK_EQ(completed[0], 1);
+    CHECK_EQ(completed[2], 3);
+    CHECK_EQ(ipg[0], 0x15);
+    CHECK_EQ(ipg[1], 0x10);
+    CHECK_EQ(ipg[2], 0x1A);
+    CHECK_EQ(memcmp(node, adapter.nodeID, 6), 0);
+}
+
+TEST(write_data_is_copied_when_queued) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    adapter.paused = true;
+    uint8_t table[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    CHECK(asix.controlRequest(0x40, 22, 0, 0, 8, table));
+    memset(table, 0, sizeof(table));
+    adapter.paused = false;
+    adapter.run();
+    const uint8_t expected[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    CHECK_EQ(memcmp(adapter.multicast, expected, 8), 0);
+}
+
+TEST(full_ring_is_refused) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    adapter.paused = true;
+    for(int i = 0; i < 8; i++) CHECK(asix.controlRequest(0x40, 38, 0x3F, 0, 0));
+    CHECK(!asix.controlRequest(0x40, 38, 0x3F, 0, 0));
+    CHECK(!asix.controlRequest(0xC0, 19, 0, 0, 9));    //Longer than a request holds
+    adapter.paused = false;
+    CHECK_EQ(adapter.run(), 8);
+    CHECK(asix.controlIdle());
+    CHECK(asix.controlRequest(0x40, 38, 0x3F, 0, 0));
+    CHECK_EQ(adapter.run(), 1);
+}
+
+TEST(requests_wait_for_the_bring_up_script) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    adapter.paused = true;
+    CHECK(adapter.plug());
+    CHECK(asix.controlRequest(0x40, 38, 0x1234, 0, 0));
+    adapter.paused = false;
+    adapter.run();
+    //Sent after every script step, the script's own jam limit write is 0x3F
+    CHECK_EQ(adapter.log.back().bRequest, 38);
+    CHECK_EQ(adapter.log.back().wValue, 0x1234);
+    CHECK_EQ(adapter.count(38), 2);
+}
+
+TEST(requests_queued_during_a_relink_run_after_it) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    CHECK(adapter.setLink(false));
+    adapter.paused = true;
+    CHECK(adapter.setLink(true));
+    CHECK(asix.controlRequest(0x40, 38, 0x1234, 0, 0));
+    adapter.paused = false;
+    adapter.run();
+    CHECK(asix.connected);
+    CHECK_EQ(adapter.log.back().bRequest, 38);
+    CHECK(asix.controlIdle());
+}
+
+TEST(phy_access_takes_and_releases_ownership) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    adapter.log.clear();
+    uint16_t value = 0;
+    CHECK(asix.readPHY(2, &value));
+    CHECK(asix.writePHY(4, 0x0DE1));
+    adapter.run();
+    CHECK_EQ(value, 0x003B);
+    CHECK_EQ(adapter.phy[4], 0x0DE1);
+    CHECK(!adapter.stationOwned);
+    CHECK_EQ(adapter.log.size(), 6);
+    CHECK_EQ(adapter.log[0].bRequest, 6);
+    CHECK_EQ(adapter.log[2].bRequest, 10);
+}
+
+static uint16_t phy_read;
+static void on_phy(void *context, const uint8_t *data, uint16_t length) {
+    completed.push_back((uint32_t)(uintptr_t)context);
+    if(context == (void*)1) phy_read = data[0] | (data[1] << 8);
+}
+
+TEST(phy_access_calls_back_when_done) {
+    completed.clear();
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    adapter.paused = true;
+    phy_read = 0;
+    CHECK(asix.readPHY(2, NULL, on_phy, (void*)1));
+    CHECK(asix.writePHY(4, 0x0DE1, on_phy, (void*)2));
+    CHECK(completed.empty());
+    adapter.paused = false;
+    adapter.run();
+    CHECK_EQ(completed.size(), 2);
+    CHECK_EQ(completed[0], 1);
+    CHECK_EQ(completed[1], 2);
+    CHECK_EQ(phy_read, 0x003B);
+    CHECK_EQ(adapter.phy[4], 0x0DE1);
+}
+
+TEST(phy_access_needs_room_for_all_three_requests) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    adapter.paused = true;
+    for(int i = 0; i < 6; i++) CHECK(asix.controlRequest(0x40, 38, 0x3F, 0, 0));
+    uint16_t value;
+    CHECK(!asix.readPHY(1, &value));
+    CHECK(!asix.controlIdle());
+    adapter.paused = false;
+    CHECK_EQ(adapter.run(), 6);
+}
+
+static bool requeued;
+static void requeue_control(void *context, const uint8_t *data, uint16_t length) {
+    TestDriver *asix = (TestDriver*)context;
+    requeued = asix->controlRequest(0x40, 38, 0x3F, 0, 0);
+}
+
+TEST(transfers_last_with_everything_queued) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    CHECK_EQ(adapter.rxQueued(), 4);
+    Bytes frame = testFrame(100);
+    for(int i = 0; i < 8; i++) CHECK_EQ(asix.trySend(frame.data(), frame.size()), ASIXEthernetBase::TX_SENT);
+    adapter.paused = true;
+    CHECK(asix.controlRequest(0xC0, 19, 0, 0, 6, NULL, NULL, requeue_control, &asix));
+    CHECK(asix.controlRequest(0x40, 38, 0x3F, 0, 0));
+    //Bulk in requeues from its callback while every other transfer is out
+    adapter.queueFrames(testFrames(3, 100));
+    CHECK_EQ(adapter.pump(), 1);
+    CHECK_EQ(adapter.rxQueued(), 4);
+    requeued = false;
+    adapter.paused = false;
+    CHECK_EQ(adapter.run(), 3);
+    CHECK(requeued);
+    CHECK_EQ(host.mock_failed_queues(), 0);
+    CHECK_EQ(adapter.completeTx(), 8);
+}
+
+TEST(rx_mode_refused_on_a_full_ring_leaves_the_mode_alone) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    uint8_t mode = asix.rxMode();
+    adapter.log.clear();
+    adapter.paused = true;
+    for(int i = 0; i < 8; i++) CHECK(asix.controlRequest(0x40, 38, 0x3F, 0, 0));
+    CHECK(!asix.setRxMode(ASIXEthernetBase::RX_MODE_PROMISCUOUS));
+    CHECK(!asix.rxModePending());
+    CHECK_EQ(asix.rxMode(), mode);
+    adapter.paused = false;
+    adapter.run();
+    CHECK_EQ(adapter.count(16), 0);
+    //The next bring-up programs the mode that was accepted, not the refused one
+    adapter.unplug();
+    CHECK(adapter.bringUp());
+    CHECK_EQ(asix.rxMode(), mode);
+    CHECK(adapter.last(16));
+    CHECK_EQ(adapter.last(16)->wValue & 0x0001, 0);
+    CHECK(asix.setRxMode(ASIXEthernetBase::RX_MODE_BROADCAST | ASIXEthernetBase::RX_MODE_PROMISCUOUS));
+    CHECK(asix.rxModePending());
+    adapter.run();
+    CHECK(!asix.rxModePending());
+    CHECK_EQ(adapter.last(16)->wValue & 0x0001, 0x0001);
+}
+
+TEST(multicast_join_refused_on_a_full_ring_is_retried) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    const uint8_t group[6] = {0x01, 0x00, 0x5E, 0x00, 0x00, 0xFB};
+    adapter.log.clear();
+    adapter.paused = true;
+    for(int i = 0; i < 8; i++) CHECK(asix.controlRequest(0x40, 38, 0x3F, 0, 0));
+    CHECK(!asix.joinMulticast(group));
+    CHECK(!asix.leaveMulticast(group));     //Never joined
+    adapter.paused = false;
+    adapter.run();
+    CHECK_EQ(adapter.count(22), 0);
+    //The same table again still gets written
+    CHECK(asix.joinMulticast(group));
+    adapter.run();
+    CHECK_EQ(adapter.count(22), 1);
+    uint8_t zero[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    CHECK(memcmp(adapter.multicast, zero, 8) != 0);
+    //A refused leave keeps the group joined
+    adapter.paused = true;
+    for(int i = 0; i < 8; i++) CHECK(asix.controlRequest(0x40, 38, 0x3F, 0, 0));
+    CHECK(!asix.leaveMulticast(group));
+    adapter.paused = false;
+    adapter.run();
+    CHECK(asix.leaveMulticast(group));
+    adapter.run();
+    CHECK_EQ(memcmp(adapter.multicast, zero, 8), 0);
+}
+
+static Bytes callback_data;
+static TestDriver *callback_driver;
+static void requeue_then_read(void *context, const uint8_t *data, uint16_t length) {
+    const uint8_t fill[8] = {0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA};
+    callback_driver->controlRequest(0x40, 22, 0, 0, 8, fill);
+    callback_data.assign(data, data + length);
+}
+
+TEST(callback_data_survives_a_request_queued_into_its_slot) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    callback_driver = &asix;
+    callback_data.clear();
+    adapter.paused = true;
+    CHECK(asix.controlRequest(0xC0, 19, 0, 0, 6, NULL, NULL, requeue_then_read, NULL));
+    for(int i = 0; i < 7; i++) CHECK(asix.controlRequest(0x40, 38, 0x3F, 0, 0));
+    adapter.paused = false;
+    adapter.run();
+    CHECK_EQ(callback_data.size(), 6);
+    CHECK_EQ(memcmp(callback_data.data(), adapter.nodeID, 6), 0);
+    CHECK_EQ(adapter.count(22), 1);
+}
+
+static void fill_ring(void *context) {
+    while(callback_driver->controlRequest(0x40, 38, 0x3F, 0, 0)) {}
+}
+
+TEST(phy_access_is_queued_whole_even_if_the_interrupt_fills_the_ring) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    callback_driver = &asix;
+    adapter.log.clear();
+    adapter.paused = true;
+    for(int i = 0; i < 4; i++) CHECK(asix.controlRequest(0x40, 38, 0x3F, 0, 0));
+    uint16_t value = 0;
+    mock_raise_irq(fill_ring, NULL);
+    CHECK(asix.readPHY(2, &value));
+    adapter.paused = false;
+    adapter.run();
+    CHECK_EQ(value, 0x003B);
+    CHECK(!adapter.stationOwned);
+    CHECK_EQ(adapter.count(6), 1);
+    CHECK_EQ(adapter.count(10), 1);
+}
@@ -0,0 +1,99 @@
+//Frames dispatched to per EtherType handlers
+
+#include "Harness.h"
+
+static USBHost host;
+
+static std::vector<Bytes> arp, ipv6, mine;
+static void on_arp(const uint8_t *data, uint32_t length) {arp.push_back(Bytes(data, data + length));}
+static void on_ipv6(const uint8_t *data, uint32_t length) {ipv6.push_back(Bytes(data, data + length));}
+static void on_mine(const uint8_t *data, uint32_t length) {mine.push_back(Bytes(data, data + length));}
+
+static void reset() {
+    arp.clear();
+    ipv6.clear();
+    mine.clear();
+}
+
+//Two EtherTypes with the same hash, so they share a probe chain
+static void colliding(uint16_t &a, uint16_t &b) {
+    a = 0x88B5;
+    for(b = a + 1; ; b++) {
+        uint8_t ha = (a ^ (a >> 4) ^ (a >> 8)) & 15;
+        uint8_t hb = (b ^ (b >> 4) ^ (b >> 8)) & 15;
+        if(ha == hb) return;
+    }
+}
+
+TEST(frames_go_to_their_ethertype_handler) {
+    reset();
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    CHECK(asix.setHandleEtherType(0x0806, on_arp));
+    CHECK(asix.setHandleEtherType(0x86DD, on_ipv6));
+    CHECK(adapter.bringUp());
+    std::vector<Bytes> frames;
+    CHECK(FakeASIX::loadPcap(testData("mixed.pcap"), frames));
+    adapter.queueFrames(frames);
+    while(adapter.rxWaiting()) CHECK(adapter.pump());
+    CHECK_EQ(arp.size() + ipv6.size() + capture::frames.size(), frames.size());
+    CHECK_EQ(arp.size(), 5);
+    CHECK_EQ(ipv6.size(), 5);
+    for(const Bytes &frame : arp) CHECK_EQ((frame[12] << 8) | frame[13], 0x0806);
+    for(const Bytes &frame : capture::frames) CHECK((frame[12] << 8 | frame[13]) != 0x0806);
+}
+
+TEST(destination_handler_wins_over_any_destination) {
+    reset();
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    CHECK(asix.setHandleEtherType(0x0800, on_arp));
+    CHECK(asix.setHandleEtherType(0x0800, on_mine, asix.nodeID));
+    std::vector<Bytes> frames;
+    frames.push_back(testFrame(100, 0x0800, 1));
+    frames.push_back(testFrame(100, 0x0800, 2, asix.nodeID));
+    adapter.queueFrames(frames);
+    CHECK_EQ(adapter.pump(), 1);
+    CHECK_EQ(arp.size(), 1);
+    CHECK_EQ(mine.size(), 1);
+    CHECK(mine[0] == frames[1]);
+}
+
+TEST(removing_an_entry_keeps_the_probe_chain) {
+    reset();
+    uint16_t a, b;
+    colliding(a, b);
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    CHECK(adapter.bringUp());
+    CHECK(asix.setHandleEtherType(a, on_arp));
+    CHECK(asix.setHandleEtherType(b, on_ipv6));
+    CHECK(asix.setHandleEtherType(a, NULL));
+    std::vector<Bytes> frames;
+    frames.push_back(testFrame(80, a));
+    frames.push_back(testFrame(80, b));
+    adapter.queueFrames(frames);
+    CHECK_EQ(adapter.pump(), 1);
+    CHECK_EQ(arp.size(), 0);
+    CHECK_EQ(ipv6.size(), 1);
+    CHECK_EQ(capture::frames.size(), 1);
+    //The deleted slot is reused
+    CHECK(asix.setHandleEtherType(a, on_mine));
+    adapter.queueFrames(frames);
+    CHECK_EQ(adapter.pump(), 1);
+    CHECK_EQ(mine.size(), 1);
+    CHECK_EQ(ipv6.size(), 2);
+}
+
+TEST(table_full_is_refused) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    for(uint16_t i = 0; i < 16; i++) CHECK(asix.setHandleEtherType(0x9000 + i, on_arp));
+    CHECK(!asix.setHandleEtherType(0x9100, on_arp));
+    CHECK(asix.setHandleEtherType(0x9003, on_ipv6));  //Replacing still works
+    CHECK(asix.setHandleEtherType(0x9003, NULL));
+    CHECK(asix.setHandleEtherType(0x9100, on_arp));
+}
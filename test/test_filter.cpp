@@ -0,0 +1,55 @@
+//Packet filter rules checked before the recieve callbacks
+
+#include "Harness.h"
+
+static USBHost host;
+
+TEST(rules_drop_and_accept_frames) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    CHECK(adapter.bringUp());
+    asix.clearStatistics();
+    //Drop ARP, keep everything else
+    CHECK_EQ(asix.addFilterRule(12, 0xFFFF0000, 0x08060000, ASIXEthernetBase::FILTER_DROP), 0);
+    std::vector<Bytes> frames;
+    frames.push_back(testFrame(100, 0x0800, 1));
+    frames.push_back(testFrame(60, 0x0806, 2));
+    frames.push_back(testFrame(100, 0x86DD, 3));
+    adapter.queueFrames(frames);
+    CHECK_EQ(adapter.pump(), 1);
+    CHECK_EQ(capture::frames.size(), 2);
+    CHECK(capture::frames[0] == frames[0]);
+    CHECK(capture::frames[1] == frames[2]);
+    CHECK_EQ(asix.filterHits(0), 1);
+    ASIXEthernetBase::statistics_t stats;
+    asix.getStatistics(stats);
+    CHECK_EQ(stats.rxFilteredFrames, 1);
+}
+
+TEST(default_drop_keeps_only_accepted_frames) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    CHECK(adapter.bringUp());
+    CHECK_EQ(asix.addFilterRule(12, 0xFFFF0000, 0x86DD0000, ASIXEthernetBase::FILTER_ACCEPT), 0);
+    asix.setFilterDefault(ASIXEthernetBase::FILTER_DROP);
+    std::vector<Bytes> frames;
+    frames.push_back(testFrame(100, 0x0800, 1));
+    frames.push_back(testFrame(100, 0x86DD, 2));
+    adapter.queueFrames(frames);
+    CHECK_EQ(adapter.pump(), 1);
+    CHECK_EQ(capture::frames.size(), 1);
+    CHECK(capture::frames[0] == frames[1]);
+}
+
+TEST(rules_are_refused_with_only_the_raw_callback) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieve(capture::transfer);
+    CHECK(adapter.bringUp());
+    CHECK_EQ(asix.addFilterRule(12, 0xFFFF0000, 0x08060000, ASIXEthernetBase::FILTER_DROP), -1);
+    //Fine once frames are deframed for an EtherType handler
+    CHECK(asix.setHandleEtherType(0x0806, capture::frame));
+    CHECK_EQ(asix.addFilterRule(12, 0xFFFF0000, 0x08060000, ASIXEthernetBase::FILTER_DROP), 0);
+}
@@ -0,0 +1,167 @@
+//Claim, bring-up script and link scripts against the fake adapter
+
+#include "Harness.h"
+
+static USBHost host;
+
+TEST(bring_up_programs_the_adapter) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    CHECK(asix.initialized);
+    CHECK(asix.connected);
+    CHECK(asix.linkUp());
+    CHECK_EQ(memcmp(asix.nodeID, adapter.nodeID, 6), 0);
+    CHECK_EQ(adapter.rxControl, 0x03D8);
+    CHECK_EQ(adapter.aggregation[0], 0x8100);
+    CHECK_EQ(adapter.aggregation[1], 0x8147);
+    CHECK_EQ(adapter.mediumMode, 0x0336);
+    CHECK_EQ(adapter.phy[4], 0x05E1);
+    CHECK(!adapter.stationOwned);
+    CHECK_EQ(adapter.rxQueued(), 4);
+    CHECK_EQ(asix.rxMode(), ASIXEthernetBase::RX_MODE_BROADCAST | ASIXEthernetBase::RX_MODE_MULTICAST);
+    CHECK(asix.controlIdle());
+    CHECK_EQ(USBHost::mock_failed_queues(), 0);
+}
+
+TEST(other_vendors_are_not_claimed) {
+    FakeASIX adapter;
+    adapter.device.idVendor = 0x0BDA;
+    TestDriver asix(host);
+    CHECK(!adapter.plug());
+    CHECK(!asix.initialized);
+}
+
+TEST(diagnostic_steps_only_run_when_enabled) {
+    FakeASIX quiet, verbose;
+    TestDriver asix(host);
+    CHECK(quiet.bringUp());
+    uint32_t requests = quiet.log.size();
+    quiet.unplug();
+    asix.setInitDiagnostics(true);
+    CHECK(verbose.bringUp());
+    CHECK(asix.connected);
+    CHECK(verbose.log.size() > requests);
+}
+
+TEST(medium_mode_follows_the_link_partner) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.plug());
+    CHECK(adapter.setLink(true, false, false, false));
+    CHECK(asix.connected);
+    CHECK(!asix.fullDuplex());
+    CHECK(!asix.PHYSpeed);
+    CHECK_EQ(adapter.mediumMode, 0x0104);     //10M half duplex
+    CHECK(adapter.setLink(false));
+    CHECK(!asix.connected);
+    CHECK(adapter.setLink(true, true, true, true));
+    CHECK(asix.connected);
+    CHECK(asix.fullDuplex());
+    CHECK_EQ(adapter.mediumMode, 0x0336);
+}
+
+static uint32_t link_ups, link_downs;
+static void link_changed(bool up, bool speed100, bool fullDuplex) {
+    if(up) link_ups++;
+    else link_downs++;
+}
+
+TEST(link_changes_are_reported) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    link_ups = link_downs = 0;
+    asix.setHandleLinkChange(link_changed);
+    CHECK(adapter.bringUp());
+    CHECK_EQ(link_ups, 1);
+    CHECK(adapter.setLink(false));
+    CHECK_EQ(link_downs, 1);
+    CHECK(adapter.setLink(true));
+    CHECK_EQ(link_ups, 2);
+    adapter.unplug();
+    CHECK_EQ(link_downs, 2);
+    CHECK(!asix.connected);
+}
+
+TEST(link_drop_during_the_link_script_waits_for_the_link) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    link_ups = link_downs = 0;
+    asix.setHandleLinkChange(link_changed);
+    CHECK(adapter.bringUp());
+    CHECK(adapter.setLink(false));
+    adapter.paused = true;
+    CHECK(adapter.setLink(true));
+    CHECK(adapter.setLink(false));
+    adapter.paused = false;
+    adapter.run();
+    CHECK(!asix.connected);
+    CHECK_EQ(link_ups, 1);
+    CHECK_EQ(link_downs, 2);
+    Bytes frame = testFrame(100);
+    CHECK_EQ(asix.trySend(frame.data(), frame.size()), ASIXEthernetBase::TX_NOT_CONNECTED);
+    CHECK(adapter.setLink(true));
+    CHECK(asix.connected);
+    CHECK_EQ(link_ups, 2);
+    CHECK_EQ(asix.trySend(frame.data(), frame.size()), ASIXEthernetBase::TX_SENT);
+}
+
+TEST(replug_uses_the_cached_setup) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    CHECK(!asix.fastInit());
+    uint32_t srom = adapter.count(11);
+    adapter.unplug();
+    CHECK(adapter.bringUp());
+    CHECK(asix.fastInit());
+    CHECK(asix.connected);
+    CHECK(adapter.count(11) < srom);
+    CHECK_EQ(memcmp(asix.nodeID, adapter.nodeID, 6), 0);
+}
+
+TEST(phy_requests_use_the_adapters_phy_address) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    adapter.phyAddress = 0x03;
+    CHECK(adapter.bringUp());
+    CHECK(asix.connected);
+    uint32_t phyRequests = 0;
+    for(const FakeASIX::request_t &r : adapter.log) {
+        if(r.bRequest != 7 && r.bRequest != 8) continue;
+        CHECK_EQ(r.wValue, 0x03);
+        phyRequests++;
+    }
+    CHECK(phyRequests > 0);
+    CHECK_EQ(asix.linkPartnerAbility(), adapter.phy[5]);
+    uint16_t value = 0;
+    CHECK(asix.readPHY(2, &value));
+    adapter.run();
+    CHECK_EQ(value, 0x003B);
+    //Cached along with the MAC
+    adapter.unplug();
+    CHECK(adapter.bringUp());
+    CHECK(asix.fastInit());
+    CHECK(adapter.last(8));
+    CHECK_EQ(adapter.last(8)->wValue, 0x03);
+}
+
+TEST(adapters_without_a_serial_are_not_cached) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    adapter.setSerial("");
+    CHECK(adapter.bringUp());
+    adapter.unplug();
+    CHECK(adapter.bringUp());
+    CHECK(!asix.fastInit());
+    CHECK(asix.connected);
+}
+
+TEST(default_geometry_uses_8k_aggregation) {
+    ASIXEthernet asix(host);
+    FakeASIX adapter;
+    CHECK(adapter.bringUp());
+    CHECK_EQ(adapter.aggregation[0], 0x8300);
+    CHECK_EQ(adapter.rxQueued(), 2);
+    adapter.unplug();
+}
@@ -0,0 +1,107 @@
+//Frames retained by the application keep their recieve buffer from the adapter
+
+#include "Harness.h"
+
+static USBHost host;
+
+static std::vector<ASIXEthernetBase::frameHandle_t> handles;
+static void retain_frame(const uint8_t *data, uint32_t length) {
+    ASIXEthernetBase::frameHandle_t handle;
+    if(capture::driver->retainFrame(handle)) handles.push_back(handle);
+    capture::frame(data, length);
+}
+
+static void queueTransfer(FakeASIX &adapter, const std::vector<Bytes> &frames) {
+    Bytes burst;
+    for(const Bytes &frame : frames) FakeASIX::appendFrame(burst, frame.data(), frame.size());
+    adapter.queueBurst(burst);
+}
+
+TEST(retained_frames_hold_their_buffer) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    handles.clear();
+    capture::driver = &asix;
+    asix.setHandleRecieveFrame(retain_frame);
+    CHECK(adapter.bringUp());
+    std::vector<Bytes> frames = testFrames(3, 400);
+    queueTransfer(adapter, frames);
+    CHECK_EQ(adapter.pump(), 1);
+    CHECK_EQ(handles.size(), 3);
+    CHECK_EQ(adapter.rxQueued(), 3);
+    //More traffic goes through the other buffers without touching the loan
+    asix.setHandleRecieveFrame(capture::frame);
+    adapter.queueFrames(testFrames(20, 1000));
+    while(adapter.rxWaiting()) CHECK(adapter.pump());
+    for(size_t i = 0; i < handles.size(); i++) {
+        CHECK_EQ(handles[i].length, frames[i].size());
+        CHECK_EQ(memcmp(handles[i].data, frames[i].data(), frames[i].size()), 0);
+    }
+    asix.releaseFrame(handles[0]);
+    asix.releaseFrame(handles[1]);
+    CHECK_EQ(adapter.rxQueued(), 3);
+    asix.releaseFrame(handles[2]);
+    CHECK_EQ(adapter.rxQueued(), 4);
+}
+
+TEST(retained_raw_transfer_holds_its_buffer) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    handles.clear();
+    capture::driver = &asix;
+    asix.setHandleRecieve(retain_frame);
+    CHECK(adapter.bringUp());
+    queueTransfer(adapter, testFrames(2, 100));
+    CHECK_EQ(adapter.pump(), 1);
+    CHECK_EQ(handles.size(), 1);
+    CHECK_EQ(handles[0].length, 2 * (100 + ASIXFraming::rxHeaderSize));
+    CHECK_EQ(adapter.rxQueued(), 3);
+    asix.releaseFrame(handles[0]);
+    CHECK_EQ(adapter.rxQueued(), 4);
+}
+
+TEST(loans_outlive_a_disconnect) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    handles.clear();
+    capture::driver = &asix;
+    asix.setHandleRecieveFrame(retain_frame);
+    CHECK(adapter.bringUp());
+    queueTransfer(adapter, testFrames(1, 400));
+    CHECK_EQ(adapter.pump(), 1);
+    CHECK_EQ(handles.size(), 1);
+    adapter.unplug();
+    asix.setHandleRecieveFrame(capture::frame);
+    CHECK(adapter.bringUp());
+    CHECK_EQ(adapter.rxQueued(), 3);
+    asix.releaseFrame(handles[0]);
+    CHECK_EQ(adapter.rxQueued(), 4);
+    asix.releaseFrame(handles[0]);      //Already released, does nothing
+    CHECK_EQ(adapter.rxQueued(), 4);
+}
+
+TEST(retain_outside_a_callback_fails) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    ASIXEthernetBase::frameHandle_t handle;
+    CHECK(!asix.retainFrame(handle));
+}
+
+TEST(polled_retained_buffer_is_freed_on_release) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    handles.clear();
+    capture::driver = &asix;
+    asix.setHandleRecieveFrame(retain_frame);
+    asix.setRecieveMode(ASIXEthernetBase::RX_POLLED);
+    CHECK(adapter.bringUp());
+    queueTransfer(adapter, testFrames(2, 400));
+    CHECK_EQ(adapter.pump(), 1);
+    CHECK_EQ(asix.read(0), 2);
+    CHECK_EQ(handles.size(), 2);
+    CHECK_EQ(adapter.rxQueued(), 3);
+    asix.releaseFrame(handles[1]);
+    asix.releaseFrame(handles[0]);
+    CHECK_EQ(adapter.rxQueued(), 4);
+}
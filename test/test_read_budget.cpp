@@ -0,0 +1,184 @@
+//Deferred recieve handled from read(), with frame and byte budgets
+
+#include "Harness.h"
+
+static USBHost host;
+
+//One transfer per burst
+static void queueTransfer(FakeASIX &adapter, const std::vector<Bytes> &frames) {
+    Bytes burst;
+    for(const Bytes &frame : frames) FakeASIX::appendFrame(burst, frame.data(), frame.size());
+    adapter.queueBurst(burst);
+}
+
+TEST(polled_transfers_wait_for_read) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    asix.setRecieveMode(ASIXEthernetBase::RX_POLLED);
+    CHECK(adapter.bringUp());
+    std::vector<Bytes> frames = testFrames(9, 300);
+    for(int i = 0; i < 3; i++) queueTransfer(adapter, std::vector<Bytes>(frames.begin() + i * 3, frames.begin() + i * 3 + 3));
+    CHECK_EQ(adapter.pump(), 3);
+    CHECK(capture::frames.empty());
+    CHECK(asix.rxPending());
+    CHECK_EQ(adapter.rxQueued(), 1);
+    CHECK_EQ(asix.read(0), 9);
+    CHECK(capture::frames == frames);
+    CHECK(!asix.rxPending());
+    CHECK_EQ(adapter.rxQueued(), 4);
+}
+
+TEST(frame_budget_resumes_part_way_through_a_transfer) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    asix.setRecieveMode(ASIXEthernetBase::RX_POLLED);
+    CHECK(adapter.bringUp());
+    std::vector<Bytes> frames = testFrames(10, 200);
+    queueTransfer(adapter, std::vector<Bytes>(frames.begin(), frames.begin() + 7));
+    queueTransfer(adapter, std::vector<Bytes>(frames.begin() + 7, frames.end()));
+    CHECK_EQ(adapter.pump(), 2);
+    bool more = false;
+    CHECK_EQ(asix.read(3, 0, &more), 3);
+    CHECK(more);
+    CHECK_EQ(capture::frames.size(), 3);
+    CHECK_EQ(adapter.rxQueued(), 2);    //The buffer part way through stays held
+    CHECK_EQ(asix.read(3, 0, &more), 3);
+    CHECK(more);
+    CHECK_EQ(asix.read(3, 0, &more), 3);
+    CHECK(more);
+    CHECK_EQ(adapter.rxQueued(), 3);
+    CHECK_EQ(asix.read(3, 0, &more), 1);
+    CHECK(!more);
+    CHECK(capture::frames == frames);
+    CHECK_EQ(adapter.rxQueued(), 4);
+}
+
+TEST(byte_budget_stops_once_reached) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    asix.setRecieveMode(ASIXEthernetBase::RX_POLLED);
+    CHECK(adapter.bringUp());
+    std::vector<Bytes> frames = testFrames(6, 600);
+    queueTransfer(adapter, frames);
+    CHECK_EQ(adapter.pump(), 1);
+    bool more = false;
+    CHECK_EQ(asix.read(0, 1500, &more), 3);
+    CHECK(more);
+    CHECK_EQ(asix.read(0, 1500, &more), 3);
+    CHECK(!more);
+    CHECK(capture::frames == frames);
+}
+
+TEST(raw_transfers_count_as_one_frame) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieve(capture::transfer);
+    asix.setRecieveMode(ASIXEthernetBase::RX_POLLED);
+    CHECK(adapter.bringUp());
+    for(int i = 0; i < 3; i++) queueTransfer(adapter, testFrames(4, 100));
+    CHECK_EQ(adapter.pump(), 3);
+    bool more = false;
+    CHECK_EQ(asix.read(2, 0, &more), 2);
+    CHECK(more);
+    CHECK_EQ(asix.read(2, 0, &more), 1);
+    CHECK(!more);
+    CHECK_EQ(capture::transfers.size(), 3);
+}
+
+TEST(split_frame_is_joined_across_budgeted_reads) {
+    FakeASIX adapter;
+    ASIXEthernetT<1024 * 2, 4, 8> asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    asix.setRecieveMode(ASIXEthernetBase::RX_POLLED);
+    CHECK(adapter.bringUp());
+    std::vector<Bytes> frames = testFrames(12, 700);
+    adapter.queueFrames(frames);
+    while(adapter.rxWaiting()) {
+        adapter.pump();
+        while(asix.read(1)) {}
+    }
+    CHECK(capture::frames == frames);
+}
+
+TEST(adaptive_mode_defers_only_while_read_lags) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    asix.setRecieveMode(ASIXEthernetBase::RX_ADAPTIVE);
+    CHECK(adapter.bringUp());
+    std::vector<Bytes> frames = testFrames(4, 100);
+    queueTransfer(adapter, std::vector<Bytes>(frames.begin(), frames.begin() + 2));
+    CHECK_EQ(adapter.pump(), 1);
+    CHECK_EQ(capture::frames.size(), 2);       //Handled in the interrupt
+    queueTransfer(adapter, std::vector<Bytes>(frames.begin() + 2, frames.end()));
+    CHECK_EQ(adapter.pump(), 1);
+    CHECK_EQ(capture::frames.size(), 2);       //Second without a read() is deferred
+    CHECK(asix.rxPending());
+    CHECK_EQ(asix.read(0), 2);
+    CHECK(capture::frames == frames);
+    queueTransfer(adapter, testFrames(1, 100));
+    CHECK_EQ(adapter.pump(), 1);
+    CHECK_EQ(capture::frames.size(), 5);       //Caught up, back in the interrupt
+}
+
+TEST(backpressure_holds_buffers_until_read_catches_up) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    asix.setRecieveMode(ASIXEthernetBase::RX_POLLED);
+    asix.setRxBackpressure(2);
+    CHECK(adapter.bringUp());
+    asix.clearStatistics();
+    for(int i = 0; i < 3; i++) {
+        queueTransfer(adapter, testFrames(1, 200));
+        CHECK_EQ(adapter.pump(), 1);
+    }
+    CHECK_EQ(adapter.rxQueued(), 1);
+    CHECK_EQ(asix.read(1), 1);
+    CHECK_EQ(adapter.rxQueued(), 1);           //Two still waiting, held back
+    mock_advance_micros(500);
+    CHECK_EQ(asix.read(0), 2);
+    CHECK_EQ(adapter.rxQueued(), 4);
+    ASIXEthernetBase::statistics_t stats;
+    asix.getStatistics(stats);
+    CHECK_EQ(stats.rxHeldBackEvents, 1);
+    CHECK_EQ(stats.rxHeldBackMicros, 500);
+    for(int i = 0; i < 3; i++) {                //Second episode adds to the first
+        queueTransfer(adapter, testFrames(1, 200));
+        CHECK_EQ(adapter.pump(), 1);
+    }
+    CHECK_EQ(asix.read(1), 1);
+    mock_advance_micros(300);
+    CHECK_EQ(adapter.rxQueued(), 1);           //Time alone doesn't release them
+    CHECK_EQ(asix.read(0), 2);
+    CHECK_EQ(adapter.rxQueued(), 4);
+    asix.getStatistics(stats);
+    CHECK_EQ(stats.rxHeldBackEvents, 2);
+    CHECK_EQ(stats.rxHeldBackMicros, 800);
+}
+
+TEST(backpressure_off_keeps_every_buffer_queued) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    asix.setRecieveMode(ASIXEthernetBase::RX_POLLED);
+    asix.setRxBackpressure(0);
+    CHECK(adapter.bringUp());
+    asix.clearStatistics();
+    for(int i = 0; i < 3; i++) {
+        queueTransfer(adapter, testFrames(1, 200));
+        CHECK_EQ(adapter.pump(), 1);
+    }
+    CHECK_EQ(asix.read(1), 1);
+    CHECK_EQ(adapter.rxQueued(), 2);           //Handled buffer goes straight back
+    mock_advance_micros(500);
+    CHECK_EQ(asix.read(0), 2);
+    CHECK_EQ(adapter.rxQueued(), 4);
+    ASIXEthernetBase::statistics_t stats;
+    asix.getStatistics(stats);
+    CHECK_EQ(stats.rxHeldBackEvents, 0);
+    CHECK_EQ(stats.rxHeldBackMicros, 0);
+}
@@ -0,0 +1,115 @@
+//Recieve path, captured traffic replayed into the bulk in transfers
+
+#include "Harness.h"
+
+static USBHost host;
+
+TEST(pcap_replay_delivers_every_frame_in_order) {
+    std::vector<Bytes> frames;
+    CHECK(FakeASIX::loadPcap(testData("mixed.pcap"), frames));
+    CHECK_EQ(frames.size(), 70);
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    CHECK(adapter.bringUp());
+    adapter.queueFrames(frames);
+    while(adapter.rxWaiting()) CHECK(adapter.pump());
+    CHECK(capture::frames == frames);
+    ASIXEthernetBase::statistics_t stats;
+    asix.getStatistics(stats);
+    CHECK_EQ(stats.rxFrames, frames.size());
+    CHECK_EQ(stats.rxResyncErrors, 0);
+    CHECK_EQ(stats.rxTruncatedFrames, 0);
+    CHECK_EQ(adapter.rxQueued(), 4);
+}
+
+TEST(pcap_replay_at_every_aggregation_size) {
+    std::vector<Bytes> frames;
+    CHECK(FakeASIX::loadPcap(testData("mixed.pcap"), frames));
+    for(uint32_t burst = 512; burst <= 1024 * 4; burst += 512) {
+        FakeASIX adapter;
+        TestDriver asix(host);
+        capture::reset();
+        asix.setHandleRecieveFrame(capture::frame);
+        CHECK(adapter.bringUp());
+        adapter.queueFrames(frames, burst);
+        while(adapter.rxWaiting()) CHECK(adapter.pump());
+        CHECK(capture::frames == frames);
+        adapter.unplug();
+        USBHost::mock_reset();
+    }
+}
+
+TEST(raw_callback_gets_whole_transfers) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieve(capture::transfer);
+    CHECK(adapter.bringUp());
+    Bytes burst;
+    Bytes frame = testFrame(100);
+    FakeASIX::appendFrame(burst, frame.data(), frame.size());
+    FakeASIX::appendFrame(burst, frame.data(), frame.size());
+    adapter.queueBurst(burst);
+    adapter.queueBurst(burst);
+    CHECK_EQ(adapter.pump(), 2);
+    CHECK_EQ(capture::transfers.size(), 2);
+    CHECK(capture::transfers[0] == burst);
+    CHECK(capture::frames.empty());
+}
+
+TEST(checksum_results_are_reported) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    capture::driver = &asix;
+    asix.setHandleRecieveFrame(capture::frame);
+    CHECK(adapter.bringUp());
+    Bytes burst;
+    Bytes frame = testFrame(200);
+    FakeASIX::appendFrame(burst, frame.data(), frame.size(), 0x3000);   //IPv4 TCP
+    FakeASIX::appendFrame(burst, frame.data(), frame.size(), 0x3100);   //IPv4 TCP, L4 error
+    FakeASIX::appendFrame(burst, frame.data(), frame.size(), 0x4000);   //IPv6 other
+    adapter.queueBurst(burst);
+    CHECK_EQ(adapter.pump(), 1);
+    CHECK_EQ(capture::info.size(), 3);
+    CHECK(capture::info[0].checksumVerified());
+    CHECK_EQ(capture::info[0].l4Type, ASIXEthernetBase::L4_TCP);
+    CHECK(!capture::info[1].checksumVerified());
+    CHECK(capture::info[1].l4ChecksumError);
+    CHECK_EQ(capture::info[2].l3Type, ASIXEthernetBase::L3_IPV6);
+    ASIXEthernetBase::statistics_t stats;
+    asix.getStatistics(stats);
+    CHECK_EQ(stats.rxChecksumErrors, 1);
+}
+
+TEST(corrupt_header_is_skipped) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    CHECK(adapter.bringUp());
+    Bytes burst;
+    Bytes frame = testFrame(300);
+    FakeASIX::appendFrame(burst, frame.data(), frame.size());
+    for(int i = 0; i < 20; i++) burst.push_back(0x5A);
+    FakeASIX::appendFrame(burst, frame.data(), frame.size());
+    adapter.queueBurst(burst);
+    CHECK_EQ(adapter.pump(), 1);
+    CHECK_EQ(capture::frames.size(), 2);
+    CHECK(capture::frames[1] == frame);
+    ASIXEthernetBase::statistics_t stats;
+    asix.getStatistics(stats);
+    CHECK_EQ(stats.rxResyncErrors, 1);
+}
+
+TEST(buffers_are_requeued_after_the_callback) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    asix.setHandleRecieveFrame(capture::frame);
+    CHECK(adapter.bringUp());
+    adapter.queueFrames(testFrames(40, 1514));
+    while(adapter.rxWaiting()) {
+        CHECK(adapter.pump(1));
+        CHECK_EQ(adapter.rxQueued(), 4);
+    }
+    CHECK_EQ(capture::frames.size(), 40);
+    CHECK_EQ(USBHost::mock_failed_queues(), 0);
+}
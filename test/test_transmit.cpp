@@ -0,0 +1,233 @@
+//Transmit path, frames unpacked from the bulk out transfers
+
+#include "Harness.h"
+
+static USBHost host;
+
+TEST(fragments_are_gathered_into_one_frame) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    Bytes frame = testFrame(300);
+    ASIXEthernetBase::fragment_t fragments[3] = {
+        {frame.data(), 14}, {frame.data() + 14, 100}, {frame.data() + 114, 186}};
+    asix.sendPacket(fragments, 3);
+    CHECK_EQ(adapter.completeTx(), 1);
+    CHECK(adapter.sent[0] == frame);
+}
+
+TEST(packet_size_multiple_gets_a_padding_header) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    Bytes frame = testFrame(512 - 4);
+    asix.sendPacket(frame.data(), frame.size());
+    CHECK_EQ(adapter.completeTx(), 1);
+    CHECK_EQ(adapter.sentTransfers[0], 516);
+    CHECK_EQ(adapter.sent.size(), 1);
+    CHECK(adapter.sent[0] == frame);
+    CHECK_EQ(adapter.txErrors, 0);
+}
+
+TEST(runts_are_sent_unpadded_for_the_adapter_to_pad) {
+    FakeASIX adapter;
+    ASIXEthernetT<1024 * 4, 4, 8, 4096> asix(host);
+    CHECK(adapter.bringUp());
+    Bytes runt = testFrame(42);
+    asix.sendPacket(runt.data(), runt.size());
+    CHECK_EQ(adapter.completeTx(), 1);
+    CHECK_EQ(adapter.sentTransfers[0], 4 + 42);
+    //Packed the same way
+    std::vector<Bytes> frames = testFrames(3, 42);
+    const uint8_t *data[3];
+    uint32_t lengths[3];
+    for(int i = 0; i < 3; i++) {
+        data[i] = frames[i].data();
+        lengths[i] = frames[i].size();
+    }
+    asix.sendPackets(data, lengths, 3);
+    CHECK_EQ(adapter.completeTx(), 1);
+    CHECK_EQ(adapter.sentTransfers[1], 3 * (4 + 42));
+    CHECK_EQ(adapter.sent.size(), 4);
+    CHECK(adapter.sent[0] == runt);
+    for(int i = 0; i < 3; i++) CHECK(adapter.sent[i + 1] == frames[i]);
+    CHECK_EQ(adapter.txErrors, 0);
+}
+
+TEST(send_packets_packs_one_transfer) {
+    ASIXEthernetT<1024 * 4, 4, 8, 8192> asix(host);
+    FakeASIX adapter;
+    CHECK(adapter.bringUp());
+    std::vector<Bytes> frames = testFrames(5, 1001);
+    const uint8_t *data[5];
+    uint32_t lengths[5];
+    for(int i = 0; i < 5; i++) {
+        data[i] = frames[i].data();
+        lengths[i] = frames[i].size();
+    }
+    asix.sendPackets(data, lengths, 5);
+    CHECK_EQ(adapter.completeTx(), 1);
+    CHECK(adapter.sent == frames);
+    CHECK_EQ(adapter.txErrors, 0);
+}
+
+TEST(too_long_and_not_connected_are_refused) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    Bytes frame = testFrame(1519);
+    CHECK_EQ(asix.trySend(frame.data(), 100), ASIXEthernetBase::TX_NOT_CONNECTED);
+    CHECK(adapter.bringUp());
+    CHECK_EQ(asix.trySend(frame.data(), frame.size()), ASIXEthernetBase::TX_TOO_LONG);
+    CHECK_EQ(asix.trySend(frame.data(), 1518), ASIXEthernetBase::TX_SENT);
+}
+
+static uint32_t space_calls;
+static void on_space() {space_calls++;}
+
+TEST(try_send_reports_busy_until_space) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    space_calls = 0;
+    asix.setHandleTxSpace(on_space);
+    CHECK(adapter.bringUp());
+    Bytes frame = testFrame(100);
+    for(int i = 0; i < 8; i++) CHECK_EQ(asix.trySend(frame.data(), frame.size()), ASIXEthernetBase::TX_SENT);
+    CHECK_EQ(asix.trySend(frame.data(), frame.size()), ASIXEthernetBase::TX_BUSY);
+    CHECK_EQ(asix.txQueued(), 8);
+    CHECK_EQ(adapter.completeTx(1), 1);
+    CHECK_EQ(space_calls, 1);
+    CHECK_EQ(asix.trySend(frame.data(), frame.size()), ASIXEthernetBase::TX_SENT);
+    CHECK_EQ(adapter.completeTx(), 8);
+    CHECK_EQ(adapter.sent.size(), 9);
+}
+
+static FakeASIX *waiting_adapter;
+static void complete_one() {waiting_adapter->completeTx(1);}
+
+TEST(blocking_send_waits_for_a_buffer) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    waiting_adapter = &adapter;
+    asix.setHandleWait(complete_one);
+    CHECK(adapter.bringUp());
+    std::vector<Bytes> frames = testFrames(20, 200);
+    for(const Bytes &frame : frames) asix.sendPacket(frame.data(), frame.size());
+    adapter.completeTx();
+    CHECK(adapter.sent == frames);
+}
+
+TEST(frame_built_in_place) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    Bytes frame = testFrame(700);
+    uint8_t *payload = asix.acquireTxBuffer();
+    CHECK(payload);
+    memcpy(payload, frame.data(), frame.size());
+    asix.commitTxBuffer(payload, frame.size());
+    CHECK_EQ(adapter.completeTx(), 1);
+    CHECK(adapter.sent[0] == frame);
+}
+
+TEST(sends_between_acquire_and_commit) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    Bytes first = testFrame(700, 0x0800, 1);
+    Bytes second = testFrame(300, 0x0800, 2);
+    uint8_t *payload = asix.acquireTxBuffer();
+    CHECK(payload);
+    asix.sendPacket(second.data(), second.size());
+    memcpy(payload, first.data(), first.size());
+    asix.commitTxBuffer(payload, first.size());
+    CHECK_EQ(adapter.completeTx(), 2);
+    CHECK_EQ(adapter.sent.size(), 2);
+    CHECK(adapter.sent[0] == second);
+    CHECK(adapter.sent[1] == first);
+    //Every buffer came back, none is left held
+    for(int i = 0; i < 8; i++) CHECK_EQ(asix.trySend(first.data(), first.size()), ASIXEthernetBase::TX_SENT);
+    CHECK_EQ(adapter.completeTx(), 8);
+}
+
+static TestDriver *isr_driver;
+static FakeASIX *isr_adapter;
+static Bytes isr_frame;
+static uint8_t isr_result;
+static void send_from_interrupt(void *context) {
+    isr_result = isr_driver->trySend(isr_frame.data(), isr_frame.size());
+    isr_adapter->completeTx();
+}
+
+TEST(send_from_the_interrupt_during_acquire_gets_its_own_buffer) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    Bytes frame = testFrame(700, 0x0800, 1);
+    isr_driver = &asix;
+    isr_adapter = &adapter;
+    isr_frame = testFrame(300, 0x0800, 2);
+    isr_result = 0xFF;
+    //Fires as soon as the first buffer is reserved and the mask lifts, its
+    //frame goes out and completes before the first one is committed
+    mock_raise_irq(send_from_interrupt, NULL);
+    CHECK_EQ(asix.trySend(frame.data(), frame.size()), ASIXEthernetBase::TX_SENT);
+    CHECK_EQ(isr_result, ASIXEthernetBase::TX_SENT);
+    //Buffers free in order, so the interrupt's waits behind the first one
+    //still in flight and only six more fit
+    for(int i = 0; i < 6; i++) CHECK_EQ(asix.trySend(frame.data(), frame.size()), ASIXEthernetBase::TX_SENT);
+    CHECK_EQ(asix.trySend(frame.data(), frame.size()), ASIXEthernetBase::TX_BUSY);
+    CHECK_EQ(adapter.completeTx(), 7);
+    CHECK_EQ(adapter.sent.size(), 8);
+    CHECK(adapter.sent[0] == isr_frame);
+    for(size_t i = 1; i < adapter.sent.size(); i++) CHECK(adapter.sent[i] == frame);
+}
+
+TEST(coalesced_frames_flush_on_threshold_and_timeout) {
+    FakeASIX adapter;
+    ASIXEthernetT<1024 * 4, 4, 8, 4096> asix(host);
+    CHECK(adapter.bringUp());
+    asix.setTxCoalescing(3000, 500);
+    std::vector<Bytes> frames = testFrames(4, 1000);
+    for(const Bytes &frame : frames) asix.sendPacket(frame.data(), frame.size());
+    CHECK_EQ(adapter.txQueued(), 1);        //First three reached the threshold
+    asix.read(0);
+    CHECK_EQ(adapter.txQueued(), 1);
+    mock_advance_micros(600);
+    asix.read(0);
+    CHECK_EQ(adapter.txQueued(), 2);
+    adapter.completeTx();
+    CHECK(adapter.sent == frames);
+}
+
+TEST(commit_past_buffer_size_is_refused) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    uint8_t *payload = asix.acquireTxBuffer();
+    CHECK(payload);
+    CHECK_EQ(asix.commitTxBuffer(payload, asix.txBufferSize() + 1), ASIXEthernetBase::TX_TOO_LONG);
+    CHECK_EQ(asix.commitTxBuffer(NULL, 100), ASIXEthernetBase::TX_NOT_CONNECTED);
+    //The refused buffer was still given back
+    Bytes frame = testFrame(300);
+    for(int i = 0; i < 8; i++) CHECK_EQ(asix.trySend(frame.data(), frame.size()), ASIXEthernetBase::TX_SENT);
+    CHECK_EQ(adapter.completeTx(), 8);
+    CHECK_EQ(adapter.sent.size(), 8);          //Nothing went out for the refused one
+    payload = asix.tryAcquireTxBuffer();
+    CHECK(payload);
+    memcpy(payload, frame.data(), frame.size());
+    CHECK_EQ(asix.commitTxBuffer(payload, frame.size()), ASIXEthernetBase::TX_SENT);
+}
+
+TEST(send_packets_reports_a_frame_too_long) {
+    FakeASIX adapter;
+    TestDriver asix(host);
+    CHECK(adapter.bringUp());
+    std::vector<Bytes> frames = testFrames(3, 200);
+    Bytes big(asix.txBufferSize() + 1, 0x55);
+    const uint8_t *data[4] = {frames[0].data(), big.data(), frames[1].data(), frames[2].data()};
+    uint32_t lengths[4] = {(uint32_t)frames[0].size(), (uint32_t)big.size(), (uint32_t)frames[1].size(), (uint32_t)frames[2].size()};
+    CHECK_EQ(asix.sendPackets(data, lengths, 4), ASIXEthernetBase::TX_TOO_LONG);
+    adapter.completeTx();
+    CHECK(adapter.sent == frames);             //The rest still went out
+    CHECK_EQ(asix.sendPackets(data, lengths, 1), ASIXEthernetBase::TX_SENT);
+}